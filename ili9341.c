@@ -19,9 +19,26 @@
 #include <linux/slab.h>
 #include <linux/platform_device.h>
 #include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
 #include <linux/mm.h>
 #include <linux/vmalloc.h>
 #include <linux/fb.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/pm_runtime.h>
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
+#include <linux/miscdevice.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/sort.h>
+#include <linux/atomic.h>
+#include <linux/bitops.h>
+#include <linux/kthread.h>
+#include <linux/random.h>
+#include <linux/seq_file.h>
+#include <linux/wait.h>
+#include <linux/eventfd.h>
 #include <asm/io.h>
 
 #include <linux/spi/spi.h>
@@ -29,279 +46,1630 @@
 #include "ili9341_reg.h"
 
 #include "ili9341.h"
+#include "ili9341_ioctl.h"
 
 #define BLOCKLEN (4096)
 
-static int ili9341_spi_write(struct ili9341 *ili, uint8_t byte, bool data)
+#define ILI9341_DEFIO_DELAY (HZ / 50)
+
+static char *bus = "spi";
+module_param(bus, charp, 0444);
+MODULE_PARM_DESC(bus, "Transport: spi, spi9, 8080 or null");
+
+static bool null_panel;
+module_param(null_panel, bool, 0444);
+MODULE_PARM_DESC(null_panel, "Add a panel on the null bus, without SPI");
+
+static int dc_gpio = 16;
+module_param(dc_gpio, int, 0444);
+MODULE_PARM_DESC(dc_gpio, "Data/command GPIO (not used by spi9)");
+
+static int rst_gpio = 12;
+module_param(rst_gpio, int, 0444);
+MODULE_PARM_DESC(rst_gpio, "Reset GPIO, -1 if not connected");
+
+static int wr_gpio = -1;
+module_param(wr_gpio, int, 0444);
+MODULE_PARM_DESC(wr_gpio, "8080 bus: WR strobe GPIO");
+
+static int db_gpios[ILI9341_8080_MAX_DB];
+static int db_gpios_count;
+module_param_array(db_gpios, int, &db_gpios_count, 0444);
+MODULE_PARM_DESC(db_gpios, "8080 bus: D0..D7 or D0..D15 GPIOs");
+
+static bool autotune;
+module_param(autotune, bool, 0444);
+MODULE_PARM_DESC(autotune, "Find the fastest reliable SPI clock at probe");
+
+static unsigned int tune_min_hz = 4000000;
+module_param(tune_min_hz, uint, 0444);
+MODULE_PARM_DESC(tune_min_hz, "Autotune: start (and reference) clock");
+
+static unsigned int tune_max_hz = 80000000;
+module_param(tune_max_hz, uint, 0444);
+MODULE_PARM_DESC(tune_max_hz, "Autotune: highest clock tried");
+
+static unsigned int tune_step_hz = 2000000;
+module_param(tune_step_hz, uint, 0444);
+MODULE_PARM_DESC(tune_step_hz, "Autotune: clock step");
+
+static unsigned int tune_margin = 10;
+module_param(tune_margin, uint, 0444);
+MODULE_PARM_DESC(tune_margin, "Autotune: percent below the last good clock");
+
+static unsigned int scan_hz;
+module_param(scan_hz, uint, 0444);
+MODULE_PARM_DESC(scan_hz, "Diff the framebuffer this often instead of tracking page faults (0 = deferred io)");
+
+static bool flip;
+module_param(flip, bool, 0444);
+MODULE_PARM_DESC(flip, "Double buffered framebuffer sent on FBIOPAN_DISPLAY instead of tracking page faults");
+
+static bool addr_cache = true;
+module_param(addr_cache, bool, 0644);
+MODULE_PARM_DESC(addr_cache, "Skip address commands the controller already has");
+
+static unsigned int parallel_lines = 48;
+module_param(parallel_lines, uint, 0644);
+MODULE_PARM_DESC(parallel_lines, "Diff across CPUs when a flush covers at least this many lines (0 = never)");
+
+static unsigned int trace_len = 65536;
+module_param(trace_len, uint, 0444);
+MODULE_PARM_DESC(trace_len, "Damage trace capacity in records");
+
+static unsigned int null_max_hz;
+module_param(null_max_hz, uint, 0444);
+MODULE_PARM_DESC(null_max_hz, "null bus: corrupt reads above this clock (0 = never)");
+
+/* Panel orientation; the default gives a landscape framebuffer. */
+#define ILI9341_ORIENTATION (ILI9341_SWITCH_XY | ILI9341_FLIP_X)
+
+/* A page that keeps being redrawn is still sent after this many flushes. */
+#define ILI9341_MAX_DEFER	4
+
+static unsigned int idle_ms = 5000;
+module_param(idle_ms, uint, 0444);
+MODULE_PARM_DESC(idle_ms, "Idle time without damage before the panel sleeps (ms)");
+
+static unsigned int slice_bytes = 8192;
+module_param(slice_bytes, uint, 0644);
+MODULE_PARM_DESC(slice_bytes, "Release the SPI bus after this many bytes of a flush (0 = no limit)");
+
+static unsigned int slice_us;
+module_param(slice_us, uint, 0644);
+MODULE_PARM_DESC(slice_us, "Release the SPI bus after holding it this long during a flush (0 = no limit)");
+
+static unsigned int slice_gap_us = 100;
+module_param(slice_gap_us, uint, 0644);
+MODULE_PARM_DESC(slice_gap_us, "Time left to other SPI devices between slices (us)");
+
+/* Bus slicing. Back to back spi_write()s leave other devices on the bus
+ * queueing behind the whole flush, since the bus mutex is simply retaken
+ * by the same thread. Inside a flush the bus is instead locked for a slice
+ * of at most slice_bytes or slice_us, then released for slice_gap_us so
+ * whoever is waiting gets it. Messages are split at slice boundaries; the
+ * controller keeps its RAMWR position while CS is deasserted, as it already
+ * does between BLOCKLEN chunks. */
+static void ili9341_slice_hold(struct ili9341 *ili)
 {
-	gpio_set_value(ili->gpiodc, data);
-	return spi_write(ili->spi, &byte, 1);
+	spi_bus_lock(ili->spi->master);
+	ili->slice.held = true;
+	ili->slice.start = ktime_get();
+	ili->slice.bytes = 0;
+	ili->slice.holds++;
 }
 
-static int ili9341_send_command(struct ili9341 *ili, uint8_t byte)
+static void ili9341_slice_release(struct ili9341 *ili)
 {
-	return ili9341_spi_write(ili, byte, 0);
+	struct ili9341_slice *sl = &ili->slice;
+	u64 ns;
+
+	if (!sl->held)
+		return;
+	spi_bus_unlock(ili->spi->master);
+	sl->held = false;
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), sl->start));
+	sl->hold_ns += ns;
+	if (ns > sl->max_hold_ns)
+		sl->max_hold_ns = ns;
 }
 
-static int ili9341_send_byte(struct ili9341 *ili, uint8_t byte)
+static void ili9341_slice_begin(struct ili9341 *ili)
 {
-	return ili9341_spi_write(ili, byte, 1);
+	ili->slice.active = !ili->slice.off && (slice_bytes || slice_us);
 }
 
-/*
-This routine will clock in len words of pixel data.
-*/
-static int ili9341_spi_write_datablock(struct ili9341 *ili, 
-					uint8_t *block, int len) 
+static void ili9341_slice_end(struct ili9341 *ili)
 {
-	int x, t;
-	unsigned short value;
-#if 0
-	//ToDo: send in parts if needed
-	if (len > BLOCKLEN) {
-		dev_err(ili->dev, "%s: len > blocklen (%i > %i)\n",
-			__func__, len, BLOCKLEN);
-		len = BLOCKLEN;
+	ili9341_slice_release(ili);
+	ili->slice.active = false;
+}
+
+/* Splits land on multiples of align bytes from the start of buf. */
+static int ili9341_spi_write_sliced(struct ili9341 *ili, const u8 *buf,
+				    size_t len, unsigned int align)
+{
+	struct ili9341_slice *sl = &ili->slice;
+	struct spi_transfer t = { };
+	struct spi_message m;
+	unsigned int max = READ_ONCE(slice_bytes);
+	unsigned int us = READ_ONCE(slice_us);
+	int ret;
+
+	while (len) {
+		if (!sl->held)
+			ili9341_slice_hold(ili);
+
+		t.tx_buf = buf;
+		t.len = max ? min_t(size_t, len, max - sl->bytes) : len;
+		if (t.len < len) {
+			t.len = rounddown(t.len, align);
+			if (!t.len)
+				t.len = min_t(size_t, len, align);
+		}
+		spi_message_init_with_transfers(&m, &t, 1);
+		ret = spi_sync_locked(ili->spi, &m);
+		if (ret)
+			return ret;
+		buf += t.len;
+		len -= t.len;
+		sl->bytes += t.len;
+
+		if ((max && sl->bytes >= max) ||
+		    (us && ktime_us_delta(ktime_get(), sl->start) >= us)) {
+			ili9341_slice_release(ili);
+			sl->yields++;
+			usleep_range(slice_gap_us, slice_gap_us + 50);
+		}
 	}
-#endif
-	dev_dbg(ili->dev, "%s: item=0x%p\n", __func__, (void *)ili);
-	gpio_set_value(ili->gpiodc, 1);
 
-	return spi_write(ili->spi, block, len);
+	return 0;
 }
 
+static int ili9341_spi_xfer(struct ili9341 *ili, const u8 *buf, size_t len,
+			    unsigned int align)
+{
+	if (ili->slice.active)
+		return ili9341_spi_write_sliced(ili, buf, len, align);
+	return spi_write(ili->spi, buf, len);
+}
 
-static int ili9341_set_window(struct ili9341 *ili, uint16_t x0, 
-							  uint16_t y0, uint16_t x1, uint16_t y1)
+/* 4-wire SPI: the DC GPIO selects command or data. */
+static int ili9341_spi_write(struct ili9341 *ili, const u8 *buf, size_t len,
+			     bool data)
 {
-	ili9341_send_command(ili, ILI9341_CASET); // Column addr set
-	ili9341_send_byte(ili, x0 >> 8);
-	ili9341_send_byte(ili, x0 & 0xFF); // XSTART
-	ili9341_send_byte(ili, x1 >> 8);
-	ili9341_send_byte(ili, x1 & 0xFF); // XEND
-	ili9341_send_command(ili, ILI9341_PASET); // Row addr set
-	ili9341_send_byte(ili, y0>>8);
-	ili9341_send_byte(ili, y0); // YSTART
-	ili9341_send_byte(ili, y1>>8);
-	ili9341_send_byte(ili, y1); // YEND
-	ili9341_send_command(ili, ILI9341_RAMWR); // write to RAM
-	return 0;
+	gpio_set_value(ili->gpiodc, data);
+	return ili9341_spi_xfer(ili, buf, len, 1);
 }
 
-static void ili9341_reset(struct ili9341 *ili)
+static int ili9341_spi_command(struct ili9341 *ili, u8 cmd)
 {
-	gpio_set_value(ili->gpiorst, 1);
-	mdelay(50);
+	ili->cmdbuf[0] = cmd;
+	return ili9341_spi_write(ili, ili->cmdbuf, 1, 0);
+}
 
-	gpio_set_value(ili->gpiorst, 0);
-	mdelay(50);
+static int ili9341_spi_command_params(struct ili9341 *ili, u8 cmd,
+				      const u8 *params, size_t n)
+{
+	int ret;
 
-	gpio_set_value(ili->gpiorst, 1);
-	mdelay(100);
+	ret = ili9341_spi_command(ili, cmd);
+	if (ret || !n)
+		return ret;
+	memcpy(ili->cmdbuf, params, n);
+	return ili9341_spi_write(ili, ili->cmdbuf, n, 1);
 }
 
+static int ili9341_spi_pixels(struct ili9341 *ili, const u8 *buf, size_t len)
+{
+	dev_dbg(ili->dev, "%s: item=0x%p\n", __func__, (void *)ili);
+	return ili9341_spi_write(ili, buf, len, 1);
+}
 
-/* This routine will allocate the buffer for the complete framebuffer. This
- * is one continuous chunk of 16-bit pixel values; userspace programs
- * will write here */
-static int __init ili9341_video_alloc(struct ili9341 *ili)
+/* DC stays low through the read phase; the controller ignores it there and
+ * CS has to stay asserted between command and data. */
+static int ili9341_spi_read(struct ili9341 *ili, u8 cmd, u8 *buf, size_t len)
 {
-	unsigned int frame_size;
+	/* spi_write_then_read() would wait on our own bus lock */
+	ili9341_slice_release(ili);
+	gpio_set_value(ili->gpiodc, 0);
+	ili->cmdbuf[0] = cmd;
+	return spi_write_then_read(ili->spi, ili->cmdbuf, 1, buf, len);
+}
 
-	dev_dbg(ili->dev, "%s: item=0x%p\n", __func__, (void *)ili);
+static int ili9341_spi_set_speed(struct ili9341 *ili, u32 hz)
+{
+	ili->spi->max_speed_hz = hz;
+	return spi_setup(ili->spi);
+}
 
-	frame_size = ili->info->fix.line_length * ili->info->var.yres;
-	dev_dbg(ili->dev, "%s: item=0x%p frame_size=%u\n",
-		__func__, (void *)ili, frame_size);
+static int ili9341_spi_init(struct ili9341 *ili)
+{
+	ili->gpiodc = dc_gpio;
+	gpio_request(ili->gpiodc, "ili9341 dc pin");
+	gpio_direction_output(ili->gpiodc, 0);
+	dev_info(ili->dev, "gpio %i registered\n", ili->gpiodc);
 
-	ili->pages_count = frame_size / PAGE_SIZE;
-	if ((ili->pages_count * PAGE_SIZE) < frame_size) {
-		ili->pages_count++;
-	}
-	dev_dbg(ili->dev, "%s: item=0x%p pages_count=%u\n",
-		__func__, (void *)ili, ili->pages_count);
+	return 0;
+}
 
-	ili->info->fix.smem_len = ili->pages_count * PAGE_SIZE;
-	ili->info->fix.smem_start =
-	    (unsigned long)vmalloc(ili->info->fix.smem_len);
-	if (!ili->info->fix.smem_start) {
-		dev_err(ili->dev, "%s: unable to vmalloc\n", __func__);
-		return -ENOMEM;
+static const struct ili9341_bus_ops ili9341_spi_bus = {
+	.name		= "spi",
+	.init		= ili9341_spi_init,
+	.command	= ili9341_spi_command,
+	.command_params	= ili9341_spi_command_params,
+	.pixels		= ili9341_spi_pixels,
+	.read		= ili9341_spi_read,
+	.set_speed	= ili9341_spi_set_speed,
+};
+
+/* 3-wire SPI with 9 bit words: the top bit of each word is DC, so the DC
+ * pin is not needed and command/data changes do not end a transfer. Words
+ * are bit packed into an 8 bit stream, eight words to nine bytes. Window
+ * commands are held back and go out with the pixels that follow them as
+ * one transfer; anything else is sent straight away, so init delays still
+ * fall between commands. Each transfer starts on a word boundary and ends
+ * with under 9 bits of padding, which the controller drops at CS. */
+#define ILI9341_SPI9_BUFLEN	(BLOCKLEN / 8 * 9 + 128)
+
+static void ili9341_spi9_word(struct ili9341_spi9 *s, unsigned int word)
+{
+	s->acc = (s->acc << 9) | word;
+	s->bits += 9;
+	while (s->bits >= 8) {
+		s->bits -= 8;
+		s->buf[s->len++] = s->acc >> s->bits;
 	}
-	memset((void *)ili->info->fix.smem_start, 0, ili->info->fix.smem_len);
+	s->acc &= (1 << s->bits) - 1;
+}
 
-	return 0;
+/* Eight data bytes to nine wire bytes, DC set in every word. */
+static inline void ili9341_spi9_pack8(u8 *o, const u8 *d)
+{
+	o[0] = 0x80 | d[0] >> 1;
+	o[1] = d[0] << 7 | 0x40 | d[1] >> 2;
+	o[2] = d[1] << 6 | 0x20 | d[2] >> 3;
+	o[3] = d[2] << 5 | 0x10 | d[3] >> 4;
+	o[4] = d[3] << 4 | 0x08 | d[4] >> 5;
+	o[5] = d[4] << 3 | 0x04 | d[5] >> 6;
+	o[6] = d[5] << 2 | 0x02 | d[6] >> 7;
+	o[7] = d[6] << 1 | 0x01;
+	o[8] = d[7];
 }
 
-static void ili9341_video_free(struct ili9341 *ili)
+/* Every word moves the bit position by one, so at most seven go through
+ * the slow path before the stream is byte aligned again. */
+static void ili9341_spi9_data(struct ili9341_spi9 *s, const u8 *d, size_t n)
 {
-	dev_dbg(ili->dev, "%s: item=0x%p\n", __func__, (void *)ili);
+	for (; n && s->bits; n--)
+		ili9341_spi9_word(s, 0x100 | *d++);
+	for (; n >= 8; n -= 8, d += 8, s->len += 9)
+		ili9341_spi9_pack8(s->buf + s->len, d);
+	while (n--)
+		ili9341_spi9_word(s, 0x100 | *d++);
+}
+
+static int ili9341_spi9_decode(struct ili9341 *ili, const u8 *buf,
+			       size_t len);
+
+static int ili9341_spi9_send(struct ili9341 *ili)
+{
+	struct ili9341_spi9 *s = &ili->spi9;
+	int ret;
 
-	kfree((void *)ili->info->fix.smem_start);
+	if (s->bits)
+		s->buf[s->len++] = s->acc << (8 - s->bits);
+	s->acc = 0;
+	s->bits = 0;
+	if (!s->len)
+		return 0;
+
+	if (s->mock)
+		ret = ili9341_spi9_decode(ili, s->buf, s->len);
+	else
+		ret = ili9341_spi_xfer(ili, s->buf, s->len, 9);
+	s->len = 0;
+	return ret;
 }
 
-/* This routine will allocate a ili9341_page struct for each vm page in the
- * main framebuffer memory. Each struct will contain a pointer to the page
- * start, an x- and y-offset, and the length of the pagebuffer 
- * which is in the framebuffer. */
-static int __init ili9341_pages_alloc(struct ili9341 *ili)
+static bool ili9341_spi9_window_cmd(u8 cmd)
 {
-	unsigned short pixels_per_page;
-	unsigned short yoffset_per_page;
-	unsigned short xoffset_per_page;
-	unsigned short index;
-	unsigned short x = 0;
-	unsigned short y = 0;
-	unsigned short *buffer;
-	unsigned short *oldbuffer;
-	unsigned int len;
+	return cmd == ILI9341_CASET || cmd == ILI9341_PASET ||
+	       cmd == ILI9341_RAMWR || cmd == ILI9341_RAMWRC;
+}
 
-	dev_dbg(ili->dev, "%s: item=0x%p\n", __func__, (void *)ili);
+static int ili9341_spi9_command_params(struct ili9341 *ili, u8 cmd,
+				       const u8 *params, size_t n)
+{
+	struct ili9341_spi9 *s = &ili->spi9;
+	int ret;
 
-	ili->pages = kmalloc(ili->pages_count * sizeof(struct ili9341_page),
-			      GFP_KERNEL);
-	if (!ili->pages) {
-		dev_err(ili->dev, "%s: unable to kmalloc for ili9341_page\n",
-			__func__);
-		return -ENOMEM;
+	if (s->len + (n + 1) * 9 / 8 + 2 > ILI9341_SPI9_BUFLEN) {
+		ret = ili9341_spi9_send(ili);
+		if (ret)
+			return ret;
 	}
 
-	pixels_per_page = PAGE_SIZE / (ili->info->var.bits_per_pixel / 8);
-	yoffset_per_page = pixels_per_page / ili->info->var.xres;
-	xoffset_per_page = pixels_per_page -
-	    (yoffset_per_page * ili->info->var.xres);
-	dev_info(ili->dev, "%s: item=0x%p pixels_per_page=%hu "
-		"yoffset_per_page=%hu xoffset_per_page=%hu\n",
-		__func__, (void *)ili, pixels_per_page,
-		yoffset_per_page, xoffset_per_page);
+	ili9341_spi9_word(s, cmd);
+	while (n--)
+		ili9341_spi9_word(s, 0x100 | *params++);
 
-	oldbuffer = kmalloc(ili->pages_count * pixels_per_page * 2,
-			      GFP_KERNEL);
-	if (!oldbuffer) {
-		dev_err(ili->dev, "%s: unable to kmalloc for ili9341_page oldbuffer\n",
-			__func__);
-		return -ENOMEM;
-	}
-	buffer = (unsigned short *)ili->info->fix.smem_start;
-	for (index = 0; index < ili->pages_count; index++) {
-		len = (ili->info->var.xres * ili->info->var.yres) -
-		    (index * pixels_per_page);
-		if (len > pixels_per_page) {
-			len = pixels_per_page;
+	return ili9341_spi9_window_cmd(cmd) ? 0 : ili9341_spi9_send(ili);
+}
+
+static int ili9341_spi9_command(struct ili9341 *ili, u8 cmd)
+{
+	return ili9341_spi9_command_params(ili, cmd, NULL, 0);
+}
+
+static int ili9341_spi9_pixels(struct ili9341 *ili, const u8 *buf, size_t len)
+{
+	struct ili9341_spi9 *s = &ili->spi9;
+	size_t room, n;
+	int ret;
+
+	while (len) {
+		room = (ILI9341_SPI9_BUFLEN - s->len - 2) * 8 / 9;
+		n = min(len, room);
+		if (!n) {
+			ret = ili9341_spi9_send(ili);
+			if (ret)
+				return ret;
+			continue;
 		}
-		dev_info(ili->dev,
-			"%s: page[%d]: x=%3hu y=%3hu buffer=0x%p len=%3hu\n",
-			__func__, index, x, y, buffer, len);
-		ili->pages[index].x = x;
-		ili->pages[index].y = y;
-		ili->pages[index].buffer = buffer;
-		ili->pages[index].oldbuffer = oldbuffer;
-		ili->pages[index].len = len;
+		ili9341_spi9_data(s, buf, n);
+		buf += n;
+		len -= n;
+	}
 
-		x += xoffset_per_page;
-		if (x >= ili->info->var.xres) {
-			y++;
-			x -= ili->info->var.xres;
+	return ili9341_spi9_send(ili);
+}
+
+/* Mock controller for the self test: unpacks the 9 bit stream and keeps
+ * what a panel would have latched. */
+static int ili9341_spi9_decode(struct ili9341 *ili, const u8 *buf,
+			       size_t len)
+{
+	struct ili9341_spi9_mock *m = &ili->spi9.decoded;
+	unsigned int words = len * 8 / 9;
+	unsigned int i, bit, word;
+
+	for (i = 0, bit = 0; i < words; i++, bit += 9) {
+		word = ((buf[bit / 8] << 8 | buf[bit / 8 + 1]) >>
+			(7 - bit % 8)) & 0x1ff;
+		if (!(word & 0x100)) {
+			m->cmd = word;
+			if (m->ncmds < ARRAY_SIZE(m->cmds))
+				m->cmds[m->ncmds++] = word;
+		} else if (m->cmd == ILI9341_RAMWR || m->cmd == ILI9341_RAMWRC) {
+			if (m->npixels < ARRAY_SIZE(m->pixels))
+				m->pixels[m->npixels++] = word;
+		} else if (m->nparams < ARRAY_SIZE(m->params)) {
+			m->params[m->nparams++] = word;
 		}
-		y += yoffset_per_page;
-		buffer += pixels_per_page;
-		oldbuffer += pixels_per_page;
 	}
 
 	return 0;
 }
 
-static void ili9341_pages_free(struct ili9341 *ili)
+/* Sends a window and an odd length pixel run through the real packing
+ * paths into the mock, and checks that it decodes back. */
+static int ili9341_spi9_selftest(struct ili9341 *ili)
 {
-	dev_dbg(ili->dev, "%s: ili=0x%p\n", __func__, (void *)ili);
+	static const u8 caset[] = { 0x00, 0x11, 0x01, 0x2a };
+	static const u8 paset[] = { 0x00, 0x22, 0x00, 0xe5 };
+	static const u8 cmds[] = { ILI9341_CASET, ILI9341_PASET, ILI9341_RAMWR };
+	struct ili9341_spi9_mock *m = &ili->spi9.decoded;
+	u8 pixels[ILI9341_SPI9_MOCK_BYTES - 1];
+	unsigned int i;
+	int ret;
 
-	kfree(ili->pages);
+	for (i = 0; i < sizeof(pixels); i++)
+		pixels[i] = i * 37 + 5;
+
+	memset(m, 0, sizeof(*m));
+	ili->spi9.mock = true;
+	ili9341_spi9_command_params(ili, ILI9341_CASET, caset, sizeof(caset));
+	ili9341_spi9_command_params(ili, ILI9341_PASET, paset, sizeof(paset));
+	ili9341_spi9_command(ili, ILI9341_RAMWR);
+	ili9341_spi9_pixels(ili, pixels, sizeof(pixels));
+	ili->spi9.mock = false;
+
+	ret = m->ncmds != sizeof(cmds) || memcmp(m->cmds, cmds, sizeof(cmds)) ||
+	      m->nparams != sizeof(caset) + sizeof(paset) ||
+	      memcmp(m->params, caset, sizeof(caset)) ||
+	      memcmp(m->params + sizeof(caset), paset, sizeof(paset)) ||
+	      m->npixels != sizeof(pixels) ||
+	      memcmp(m->pixels, pixels, sizeof(pixels));
+	if (ret) {
+		dev_err(ili->dev, "spi9 self test: stream does not decode\n");
+		return -EIO;
+	}
+
+	return 0;
 }
 
-static void ili9341_copy(struct ili9341 *ili, unsigned int index)
+static int ili9341_spi9_init(struct ili9341 *ili)
 {
-	unsigned int ystart, yend;
-	int chstart, chend;
-	unsigned int x;
-	unsigned int y;
-	unsigned short *buffer, *oldbuffer;
-	unsigned int len;
-	x = ili->pages[index].x;
-	y = ili->pages[index].y;
-	len = ili->pages[index].len;
-	ystart = y;
-	yend = y+(len/(ILI9341_TFTWIDTH))+1;
-	dev_dbg(ili->dev,
-		"%s: page[%u]: x=%3hu y=%3hu buffer=0x%p len=%3hu\n",
-		__func__, index, x, y, buffer, len);
+	ili->spi9.buf = devm_kmalloc(ili->dev, ILI9341_SPI9_BUFLEN,
+				     GFP_KERNEL | GFP_DMA);
+	if (!ili->spi9.buf)
+		return -ENOMEM;
 
-	//Move to start of line.
-	buffer = ili->pages[index].buffer-x;
-	oldbuffer = ili->pages[index].oldbuffer-x;
-	x = 0;
+	ili->gpiodc = -EINVAL;
+	dev_info(ili->dev, "3-wire 9 bit spi\n");
 
-	//If we arrive here, we basically assume something is written at the lines
-	//starting with y and lasting the page.
-	for (y = ystart; y < yend; y++) {
-		//Find start and end of changed data
-		chstart = -1;
-		for (x = 0; x < ILI9341_TFTWIDTH; x++) {
-			if (buffer[x] != oldbuffer[x]) {
-				oldbuffer[x] = buffer[x];
-				if (chstart == -1)
-					chstart = x;
-				chend=x;
-			}
-		}
-		if (chstart!=-1) {
-			/* Something changed this line! chstart and chend 
-			 * contain start and end x-coords. */
-			ili9341_set_window(ili, chstart, y, chend, y);
-			ili9341_spi_write_datablock(ili, &buffer[chstart], chend - chstart);
-		}
-		buffer += ILI9341_TFTWIDTH;
-		oldbuffer += ILI9341_TFTWIDTH;
-	}
+	return ili9341_spi9_selftest(ili);
 }
 
-static void ili9341_update_all(struct ili9341 *ili)
+/* No read: on 3-wire the data line turns around mid word, which the bit
+ * packed stream cannot express, so autotune is not available. */
+static const struct ili9341_bus_ops ili9341_spi9_bus = {
+	.name		= "spi9",
+	.init		= ili9341_spi9_init,
+	.command	= ili9341_spi9_command,
+	.command_params	= ili9341_spi9_command_params,
+	.pixels		= ili9341_spi9_pixels,
+	.set_speed	= ili9341_spi_set_speed,
+};
+
+/* 8080 parallel bus, 8 or 16 data lines driven from GPIOs and latched on
+ * the rising edge of WR. CS is expected to be tied low. On a 16 bit bus
+ * commands and parameters take the low byte and pixel bytes go out in
+ * pairs. */
+static void ili9341_8080_word(struct ili9341 *ili, unsigned int word)
+{
+	unsigned int i;
+
+	for (i = 0; i < ili->db_width; i++)
+		ili->db_values[i] = (word >> i) & 1;
+	gpiod_set_array_value(ili->db_width, ili->db, ili->db_values);
+	gpio_set_value(ili->gpiowr, 0);
+	gpio_set_value(ili->gpiowr, 1);
+}
+
+static int ili9341_8080_command(struct ili9341 *ili, u8 cmd)
+{
+	gpio_set_value(ili->gpiodc, 0);
+	ili9341_8080_word(ili, cmd);
+	return 0;
+}
+
+static int ili9341_8080_command_params(struct ili9341 *ili, u8 cmd,
+				       const u8 *params, size_t n)
+{
+	ili9341_8080_command(ili, cmd);
+	gpio_set_value(ili->gpiodc, 1);
+	while (n--)
+		ili9341_8080_word(ili, *params++);
+	return 0;
+}
+
+static int ili9341_8080_pixels(struct ili9341 *ili, const u8 *buf, size_t len)
 {
-	unsigned short i;
-	struct fb_deferred_io *fbdefio = ili->info->fbdefio;
-	for (i = 0; i < ili->pages_count; i++) {
-		ili->pages[i].must_update=1;
+	gpio_set_value(ili->gpiodc, 1);
+	if (ili->db_width == 16) {
+		for (; len >= 2; len -= 2, buf += 2)
+			ili9341_8080_word(ili, (buf[0] << 8) | buf[1]);
 	}
-	schedule_delayed_work(&ili->info->deferred_work, fbdefio->delay);
+	while (len--)
+		ili9341_8080_word(ili, *buf++);
+	return 0;
 }
 
-static void ili9341_update(struct fb_info *info, struct list_head *pagelist)
+static int ili9341_8080_init(struct ili9341 *ili)
 {
-	struct ili9341 *ili = (struct ili9341 *)info->par;
-	struct page *page;
-	int i;
+	unsigned int i;
+	int ret;
 
-	/* We can be called because of pagefaults (mmap'ed framebuffer, pages
-	 * returned in *pagelist) or because of kernel activity
-	 * (pages[i]/must_update!=0). Add the former to the list of the latter. */
-	list_for_each_entry(page, pagelist, lru) {
-		ili->pages[page->index].must_update=1;
+	if ((db_gpios_count != 8 && db_gpios_count != 16) ||
+	    !gpio_is_valid(wr_gpio)) {
+		dev_err(ili->dev, "8080 bus needs 8 or 16 db_gpios and wr_gpio\n");
+		return -EINVAL;
 	}
 
-	//Copy changed pages.
-	for(i = 0; i < ili->pages_count; i++) {
-		/*ToDo: Small race here between checking and setting must_update, 
-		 * maybe lock? */
-		if (ili->pages[i].must_update) {
-			ili->pages[i].must_update=0;
-			ili9341_copy(ili, i);
-		}
+	/* devm: pins already taken are released if a later one fails */
+	ili->gpiodc = dc_gpio;
+	ret = devm_gpio_request_one(ili->dev, ili->gpiodc, GPIOF_OUT_INIT_LOW,
+				    "ili9341 dc pin");
+	if (ret)
+		goto err;
+
+	ili->gpiowr = wr_gpio;
+	ret = devm_gpio_request_one(ili->dev, ili->gpiowr, GPIOF_OUT_INIT_HIGH,
+				    "ili9341 wr pin");
+	if (ret)
+		goto err;
+
+	ili->db_width = db_gpios_count;
+	for (i = 0; i < ili->db_width; i++) {
+		ret = devm_gpio_request_one(ili->dev, db_gpios[i],
+					    GPIOF_OUT_INIT_LOW,
+					    "ili9341 data pin");
+		if (ret)
+			goto err;
+		ili->db[i] = gpio_to_desc(db_gpios[i]);
 	}
+	dev_info(ili->dev, "8080 bus, %u data lines\n", ili->db_width);
+
+	return 0;
 
+err:
+	dev_err(ili->dev, "8080 bus: cannot claim gpios (%d)\n", ret);
+	return ret;
 }
 
-static inline __u32 CNVT_TOHW(__u32 val, __u32 width)
+static const struct ili9341_bus_ops ili9341_8080_bus = {
+	.name		= "8080",
+	.init		= ili9341_8080_init,
+	.command	= ili9341_8080_command,
+	.command_params	= ili9341_8080_command_params,
+	.pixels		= ili9341_8080_pixels,
+};
+
+/* Null backend: nothing leaves the CPU, bytes are only counted and
+ * timestamped. Measures what the upper layers cost on their own, on any
+ * machine. */
+static void ili9341_null_account(struct ili9341 *ili, u64 *counter,
+				 size_t len)
 {
-	return ((val<<width) + 0x7FFF - val)>>16;
+	struct ili9341_bus_stats *stats = &ili->bus_stats;
+	u64 now = ktime_get_ns();
+
+	if (!stats->first_ns)
+		stats->first_ns = now;
+	stats->last_ns = now;
+	*counter += len;
+}
+
+static int ili9341_null_command(struct ili9341 *ili, u8 cmd)
+{
+	ili9341_null_account(ili, &ili->bus_stats.commands, 1);
+	return 0;
+}
+
+static int ili9341_null_command_params(struct ili9341 *ili, u8 cmd,
+				       const u8 *params, size_t n)
+{
+	ili9341_null_command(ili, cmd);
+	ili9341_null_account(ili, &ili->bus_stats.param_bytes, n);
+	return 0;
+}
+
+static int ili9341_null_pixels(struct ili9341 *ili, const u8 *buf, size_t len)
+{
+	ili9341_null_account(ili, &ili->bus_stats.pixel_bytes, len);
+	/* Mock GRAM: keep the start of the burst for RAMRD. */
+	memcpy(ili->mock_gram, buf, min(len, sizeof(ili->mock_gram)));
+	return 0;
+}
+
+/* Mock controller replies for the autotune readbacks. Above null_max_hz
+ * every reply comes back with a flipped bit, like a link that is clocked
+ * too fast. */
+static int ili9341_null_read(struct ili9341 *ili, u8 cmd, u8 *buf, size_t len)
+{
+	static const u8 rddid[] = { 0x00, 0x00, 0x93, 0x41 };
+	static const u8 rddst[] = { 0x00, 0x94, 0x53, 0x04, 0x00 };
+	unsigned int bpp = ili->variant->bus_bpp;
+	const u8 *p = ili->mock_gram;
+	size_t i;
+
+	memset(buf, 0, len);
+	switch (cmd) {
+	case ILI9341_RDDID:
+		memcpy(buf, rddid, min(len, sizeof(rddid)));
+		break;
+	case ILI9341_RDDST:
+		memcpy(buf, rddst, min(len, sizeof(rddst)));
+		break;
+	case ILI9341_RAMRD:
+		/* Dummy byte, then 18 bit pixels whatever was written. */
+		for (i = 1; i + 3 <= len &&
+			    p + bpp <= ili->mock_gram + sizeof(ili->mock_gram);
+		     i += 3, p += bpp) {
+			if (bpp == 2) {
+				buf[i] = p[0] & 0xf8;
+				buf[i + 1] = ((p[0] << 5) | (p[1] >> 3)) & 0xfc;
+				buf[i + 2] = p[1] << 3;
+			} else {
+				memcpy(&buf[i], p, 3);
+			}
+		}
+		break;
+	}
+
+	if (null_max_hz && ili->bus_hz > null_max_hz)
+		buf[len - 1] ^= 0x80;
+
+	ili9341_null_account(ili, &ili->bus_stats.commands, 1);
+	return 0;
+}
+
+static int ili9341_null_set_speed(struct ili9341 *ili, u32 hz)
+{
+	return 0;
+}
+
+static int ili9341_null_init(struct ili9341 *ili)
+{
+	dev_info(ili->dev, "null bus, nothing is sent to the panel\n");
+	return 0;
+}
+
+static const struct ili9341_bus_ops ili9341_null_bus = {
+	.name		= "null",
+	.init		= ili9341_null_init,
+	.command	= ili9341_null_command,
+	.command_params	= ili9341_null_command_params,
+	.pixels		= ili9341_null_pixels,
+	.read		= ili9341_null_read,
+	.set_speed	= ili9341_null_set_speed,
+};
+
+static const struct ili9341_bus_ops *ili9341_buses[] = {
+	&ili9341_spi_bus,
+	&ili9341_spi9_bus,
+	&ili9341_8080_bus,
+	&ili9341_null_bus,
+};
+
+/* Anything but ili9341_set_window() may move the controller's address
+ * state, so the cached copy is dropped. */
+static void ili9341_addr_invalidate(struct ili9341 *ili)
+{
+	ili->addr.valid = false;
+}
+
+static int ili9341_send_command(struct ili9341 *ili, uint8_t byte)
+{
+	ili9341_addr_invalidate(ili);
+	return ili->bus->command(ili, byte);
+}
+
+static int ili9341_send_params(struct ili9341 *ili, uint8_t cmd,
+			       const uint8_t *params, size_t n)
+{
+	ili9341_addr_invalidate(ili);
+	return ili->bus->command_params(ili, cmd, params, n);
+}
+
+/* Pixel packers. The loop is written once and instantiated per wire format
+ * with a constant bpp, so each packer is a straight loop with no format
+ * test per pixel. */
+static __always_inline void ili9341_pack(u8 *dst, const u16 *src,
+					 unsigned int n, const unsigned int bpp)
+{
+	u16 p;
+	u8 r, g, b;
+
+	while (n--) {
+		p = *src++;
+		if (bpp == 2) {
+			/* RGB565, MSB first */
+			*dst++ = p >> 8;
+			*dst++ = p;
+		} else {
+			/* RGB666, each component left aligned in a byte */
+			r = (p >> 11) & 0x1f;
+			g = (p >> 5) & 0x3f;
+			b = p & 0x1f;
+			*dst++ = (r << 3) | (r >> 2);
+			*dst++ = (g << 2) | (g >> 4);
+			*dst++ = (b << 3) | (b >> 2);
+		}
+	}
+}
+
+static void ili9341_pack_rgb565(u8 *dst, const u16 *src, unsigned int n)
+{
+	ili9341_pack(dst, src, n, 2);
+}
+
+static void ili9341_pack_rgb666(u8 *dst, const u16 *src, unsigned int n)
+{
+	ili9341_pack(dst, src, n, 3);
+}
+
+/* Send count framebuffer pixels after a RAMWR, packed for the panel in
+ * BLOCKLEN sized pieces. */
+static int ili9341_write_pixels(struct ili9341 *ili, const u16 *pixels,
+				unsigned int count)
+{
+	const struct ili9341_variant *variant = ili->variant;
+	unsigned int chunk = BLOCKLEN / variant->bus_bpp;
+	unsigned int n;
+	int ret;
+
+	while (count) {
+		n = min(count, chunk);
+		variant->pack(ili->txbuf, pixels, n);
+		ret = ili->bus->pixels(ili, ili->txbuf, n * variant->bus_bpp);
+		if (ret)
+			return ret;
+		ili->tx_bytes += n * variant->bus_bpp;
+		pixels += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+
+/* Every caller sends exactly the window's pixels after this, which is what
+ * lets the write pointer be tracked. The page range is left open to the
+ * bottom of the screen, so a run that starts on the row the last one ended
+ * above, in the same columns, needs only RAMWRC. Otherwise only the address
+ * commands that change are sent. */
+static int ili9341_set_window(struct ili9341 *ili, uint16_t x0, 
+							  uint16_t y0, uint16_t x1, uint16_t y1)
+{
+	struct ili9341_addr *a = &ili->addr;
+	bool cache = READ_ONCE(addr_cache);
+	uint16_t ymax = cache ? ili->info->var.yres - 1 : y1;
+	uint8_t caset[4] = { x0 >> 8, x0, x1 >> 8, x1 }; // XSTART, XEND
+	uint8_t paset[4] = { y0 >> 8, y0, ymax >> 8, ymax }; // YSTART, YEND
+	unsigned int sent = 0;
+
+	if (!cache)
+		a->valid = false;
+
+	if (a->valid && x0 == a->x0 && x1 == a->x1 && y0 == a->next_y &&
+	    y1 <= a->y1) {
+		ili->bus->command(ili, ILI9341_RAMWRC); // continue in RAM
+		a->continues++;
+		sent = 1;
+	} else {
+		if (!a->valid || x0 != a->x0 || x1 != a->x1) {
+			ili->bus->command_params(ili, ILI9341_CASET, caset, 4);
+			sent += 5;
+		}
+		if (!a->valid || y0 != a->y0 || ymax != a->y1) {
+			ili->bus->command_params(ili, ILI9341_PASET, paset, 4);
+			sent += 5;
+		}
+		ili->bus->command(ili, ILI9341_RAMWR); // write to RAM
+		sent += 1;
+
+		a->x0 = x0;
+		a->x1 = x1;
+		a->y0 = y0;
+		a->y1 = ymax;
+		a->valid = cache;
+	}
+
+	/* the pointer wraps to the window start after its last row */
+	a->next_y = y1 + 1 > a->y1 ? a->y0 : y1 + 1;
+	a->saved_bytes += 11 - sent;
+	return 0;
+}
+
+static void ili9341_reset(struct ili9341 *ili)
+{
+	ili9341_addr_invalidate(ili);
+	if (!gpio_is_valid(ili->gpiorst))
+		return;
+
+	gpio_set_value(ili->gpiorst, 1);
+	mdelay(50);
+
+	gpio_set_value(ili->gpiorst, 0);
+	mdelay(50);
+
+	gpio_set_value(ili->gpiorst, 1);
+	mdelay(100);
+}
+
+
+/* This routine will allocate the buffer for the complete framebuffer. This
+ * is one continuous chunk of 16-bit pixel values; userspace programs
+ * will write here */
+static int ili9341_video_alloc(struct ili9341 *ili)
+{
+	unsigned int frame_size;
+
+	dev_dbg(ili->dev, "%s: item=0x%p\n", __func__, (void *)ili);
+
+	frame_size = ili->info->fix.line_length * ili->info->var.yres;
+	dev_dbg(ili->dev, "%s: item=0x%p frame_size=%u\n",
+		__func__, (void *)ili, frame_size);
+
+	ili->pages_count = frame_size / PAGE_SIZE;
+	if ((ili->pages_count * PAGE_SIZE) < frame_size) {
+		ili->pages_count++;
+	}
+	dev_dbg(ili->dev, "%s: item=0x%p pages_count=%u\n",
+		__func__, (void *)ili, ili->pages_count);
+
+	/* Pages cover one frame; in flip mode the memory holds two. */
+	ili->info->fix.smem_len = PAGE_ALIGN(ili->info->fix.line_length *
+					     ili->info->var.yres_virtual);
+	ili->info->fix.smem_start =
+	    (unsigned long)vmalloc_user(ili->info->fix.smem_len);
+	if (!ili->info->fix.smem_start) {
+		dev_err(ili->dev, "%s: unable to vmalloc\n", __func__);
+		return -ENOMEM;
+	}
+	memset((void *)ili->info->fix.smem_start, 0, ili->info->fix.smem_len);
+
+	return 0;
+}
+
+static void ili9341_video_free(struct ili9341 *ili)
+{
+	dev_dbg(ili->dev, "%s: item=0x%p\n", __func__, (void *)ili);
+
+	vfree((void *)ili->info->fix.smem_start);
+}
+
+/* Parallel diff. A large flush is diffed and packed in horizontal bands,
+ * one per CPU, into a frame sized wire format buffer; each line has its own
+ * span slot so bands never share state. Transmission then walks the pages in
+ * scheduler order and sends the packed spans, serialised on the bus as
+ * before. Small flushes stay inline, where waking other CPUs costs more
+ * than it saves. Stale pages are dropped before the diff here rather than
+ * before each page is sent: once a line is diffed the shadow says it is on
+ * the panel, so it has to go out. */
+static void ili9341_band_diff(struct ili9341 *ili, unsigned int y0,
+			      unsigned int y1)
+{
+	unsigned int xres = ili->info->var.xres;
+	unsigned int bpp = ili->variant->bus_bpp;
+	unsigned short *buffer = ili->pages[0].buffer + y0 * xres;
+	unsigned short *oldbuffer = ili->pages[0].oldbuffer + y0 * xres;
+	struct ili9341_span *span;
+	int chstart, chend = 0;
+	unsigned int x, y;
+
+	for (y = y0; y < y1; y++, buffer += xres, oldbuffer += xres) {
+		span = &ili->spans[y];
+		span->x0 = -1;
+		if (!ili->line_dirty[y])
+			continue;
+		ili->line_dirty[y] = 0;
+
+		chstart = -1;
+		for (x = 0; x < xres; x++) {
+			if (buffer[x] != oldbuffer[x]) {
+				oldbuffer[x] = buffer[x];
+				if (chstart == -1)
+					chstart = x;
+				chend = x;
+			}
+		}
+		if (chstart == -1)
+			continue;
+
+		span->x0 = chstart;
+		span->x1 = chend;
+		ili->variant->pack(ili->packbuf + (y * xres + chstart) * bpp,
+				   &oldbuffer[chstart], chend - chstart + 1);
+	}
+}
+
+static void ili9341_band_work(struct work_struct *work)
+{
+	struct ili9341_band *band = container_of(work, struct ili9341_band,
+						 work);
+
+	ili9341_band_diff(band->ili, band->y0, band->y1);
+}
+
+static void ili9341_bands_free(struct ili9341 *ili)
+{
+	vfree(ili->packbuf);
+	kfree(ili->line_dirty);
+	kfree(ili->spans);
+	kfree(ili->bands);
+	ili->packbuf = NULL;
+	ili->line_dirty = NULL;
+	ili->spans = NULL;
+	ili->bands = NULL;
+}
+
+static int ili9341_bands_alloc(struct ili9341 *ili)
+{
+	struct fb_info *info = ili->info;
+	unsigned int b, h;
+
+	ili->bands_count = clamp(num_online_cpus(), 1U,
+				 (unsigned int)ILI9341_MAX_BANDS);
+	ili->bands = kcalloc(ili->bands_count, sizeof(*ili->bands),
+			     GFP_KERNEL);
+	ili->spans = kcalloc(info->var.yres, sizeof(*ili->spans), GFP_KERNEL);
+	ili->line_dirty = kzalloc(info->var.yres, GFP_KERNEL);
+	ili->packbuf = vmalloc(info->var.xres * info->var.yres *
+			       ili->variant->bus_bpp);
+	if (!ili->bands || !ili->spans || !ili->line_dirty || !ili->packbuf) {
+		ili9341_bands_free(ili);
+		return -ENOMEM;
+	}
+
+	h = DIV_ROUND_UP(info->var.yres, ili->bands_count);
+	for (b = 0; b < ili->bands_count; b++) {
+		INIT_WORK(&ili->bands[b].work, ili9341_band_work);
+		ili->bands[b].ili = ili;
+		ili->bands[b].y0 = min(b * h, info->var.yres);
+		ili->bands[b].y1 = min((b + 1) * h, info->var.yres);
+	}
+
+	return 0;
+}
+
+
+/* This routine will allocate a ili9341_page struct for each vm page in the
+ * main framebuffer memory. Each struct will contain a pointer to the page
+ * start, an x- and y-offset, and the length of the pagebuffer 
+ * which is in the framebuffer. */
+static int ili9341_pages_alloc(struct ili9341 *ili)
+{
+	unsigned short pixels_per_page;
+	unsigned short yoffset_per_page;
+	unsigned short xoffset_per_page;
+	unsigned short index;
+	unsigned short x = 0;
+	unsigned short y = 0;
+	unsigned short *buffer;
+	unsigned short *oldbuffer;
+	unsigned int len;
+
+	dev_dbg(ili->dev, "%s: item=0x%p\n", __func__, (void *)ili);
+
+	ili->pages = kmalloc(ili->pages_count * sizeof(struct ili9341_page),
+			      GFP_KERNEL);
+	if (!ili->pages) {
+		dev_err(ili->dev, "%s: unable to kmalloc for ili9341_page\n",
+			__func__);
+		return -ENOMEM;
+	}
+
+	ili->flush_order = kmalloc(ili->pages_count *
+				   sizeof(struct ili9341_flush_entry),
+				   GFP_KERNEL);
+	if (!ili->flush_order) {
+		dev_err(ili->dev, "%s: unable to kmalloc for flush order\n",
+			__func__);
+		kfree(ili->pages);
+		return -ENOMEM;
+	}
+
+	ili->dirty = kcalloc(BITS_TO_LONGS(ili->pages_count),
+			     sizeof(unsigned long), GFP_KERNEL);
+	if (!ili->dirty) {
+		dev_err(ili->dev, "%s: unable to kmalloc for dirty bitmap\n",
+			__func__);
+		kfree(ili->flush_order);
+		kfree(ili->pages);
+		return -ENOMEM;
+	}
+
+	pixels_per_page = PAGE_SIZE / (ili->info->var.bits_per_pixel / 8);
+	yoffset_per_page = pixels_per_page / ili->info->var.xres;
+	xoffset_per_page = pixels_per_page -
+	    (yoffset_per_page * ili->info->var.xres);
+	dev_dbg(ili->dev, "%s: item=0x%p pixels_per_page=%hu "
+		"yoffset_per_page=%hu xoffset_per_page=%hu\n",
+		__func__, (void *)ili, pixels_per_page,
+		yoffset_per_page, xoffset_per_page);
+
+	oldbuffer = kmalloc(ili->pages_count * pixels_per_page * 2,
+			      GFP_KERNEL);
+	if (!oldbuffer) {
+		dev_err(ili->dev, "%s: unable to kmalloc for ili9341_page oldbuffer\n",
+			__func__);
+		kfree(ili->dirty);
+		kfree(ili->flush_order);
+		kfree(ili->pages);
+		return -ENOMEM;
+	}
+	buffer = (unsigned short *)ili->info->fix.smem_start;
+	for (index = 0; index < ili->pages_count; index++) {
+		len = (ili->info->var.xres * ili->info->var.yres) -
+		    (index * pixels_per_page);
+		if (len > pixels_per_page) {
+			len = pixels_per_page;
+		}
+		dev_dbg(ili->dev,
+			"%s: page[%d]: x=%3hu y=%3hu buffer=0x%p len=%3hu\n",
+			__func__, index, x, y, buffer, len);
+		ili->pages[index].x = x;
+		ili->pages[index].y = y;
+		ili->pages[index].buffer = buffer;
+		ili->pages[index].oldbuffer = oldbuffer;
+		ili->pages[index].len = len;
+		ili->pages[index].stamp = 0;
+		ili->pages[index].deferred = 0;
+
+		x += xoffset_per_page;
+		if (x >= ili->info->var.xres) {
+			y++;
+			x -= ili->info->var.xres;
+		}
+		y += yoffset_per_page;
+		buffer += pixels_per_page;
+		oldbuffer += pixels_per_page;
+	}
+
+	if (ili9341_bands_alloc(ili)) {
+		dev_err(ili->dev, "%s: unable to allocate diff bands\n",
+			__func__);
+		kfree(ili->pages[0].oldbuffer);
+		kfree(ili->dirty);
+		kfree(ili->flush_order);
+		kfree(ili->pages);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void ili9341_pages_free(struct ili9341 *ili)
+{
+	dev_dbg(ili->dev, "%s: ili=0x%p\n", __func__, (void *)ili);
+
+	ili9341_bands_free(ili);
+	kfree(ili->pages[0].oldbuffer);
+	kfree(ili->dirty);
+	kfree(ili->flush_order);
+	kfree(ili->pages);
+}
+
+/* First line and one past the last line a page touches. */
+static void ili9341_page_lines(struct ili9341 *ili, unsigned int index,
+			       unsigned int *ystart, unsigned int *yend)
+{
+	struct ili9341_page *page = &ili->pages[index];
+
+	*ystart = page->y;
+	*yend = page->y + (page->x + page->len +
+			   ili->info->var.xres - 1) / ili->info->var.xres;
+}
+
+/* Damage is recorded without locks so that fb ops on any CPU never wait for
+ * a flush in progress: producers set a bit per page and the flush swaps the
+ * whole bitmap out with xchg() before it looks at any pixels. Whatever is
+ * drawn after that point sets the bit again and is picked up next time. */
+static unsigned long ili9341_damage_stamp(struct ili9341 *ili)
+{
+	return atomic_long_inc_return(&ili->damage_seq);
+}
+
+static void ili9341_damage_page(struct ili9341 *ili, unsigned int index,
+				unsigned long stamp)
+{
+	WRITE_ONCE(ili->pages[index].stamp, stamp);
+	/* The stamp must be visible before the bit that publishes it. */
+	smp_mb__before_atomic();
+	set_bit(index, ili->dirty);
+}
+
+static void ili9341_trace(struct ili9341 *ili, u8 type, u16 x, u16 y,
+			  u16 w, u16 h, u32 bytes)
+{
+	struct ili9341_trace *tr = &ili->trace;
+	struct ili9341_trace_rec *rec;
+	unsigned long flags;
+
+	if (!READ_ONCE(tr->enable))
+		return;
+
+	spin_lock_irqsave(&tr->lock, flags);
+	if (!tr->enable) {
+		/* raced with disable */
+	} else if (tr->count < tr->len) {
+		rec = &tr->recs[tr->count++];
+		rec->ts_ns = ktime_get_ns();
+		rec->type = type;
+		rec->x = x;
+		rec->y = y;
+		rec->w = w;
+		rec->h = h;
+		rec->bytes = bytes;
+	} else {
+		tr->dropped++;
+	}
+	spin_unlock_irqrestore(&tr->lock, flags);
+}
+
+/* Note a sent run that overwrote the cursor cell, so it gets redrawn. */
+static void ili9341_cursor_hit(struct ili9341 *ili, unsigned int x0,
+			       unsigned int x1, unsigned int y)
+{
+	const struct ili9341_cursor_state *cs = &ili->cursor.drawn;
+
+	if (cs->enable && y >= cs->y && y < cs->y + cs->h &&
+	    x1 >= cs->x && x0 < cs->x + cs->w)
+		ili->cursor.hit = true;
+}
+
+static void ili9341_copy(struct ili9341 *ili, unsigned int index)
+{
+	unsigned int ystart, yend;
+	int chstart, chend;
+	unsigned int x;
+	unsigned int y;
+	unsigned short *buffer, *oldbuffer;
+	unsigned int len;
+	unsigned int xres = ili->info->var.xres;
+	x = ili->pages[index].x;
+	y = ili->pages[index].y;
+	len = ili->pages[index].len;
+	ili9341_page_lines(ili, index, &ystart, &yend);
+	dev_dbg(ili->dev,
+		"%s: page[%u]: x=%3hu y=%3hu buffer=0x%p len=%3hu\n",
+		__func__, index, x, y, ili->pages[index].buffer, len);
+
+	//Move to start of line.
+	buffer = ili->pages[index].buffer-x;
+	oldbuffer = ili->pages[index].oldbuffer-x;
+	x = 0;
+
+	//If we arrive here, we basically assume something is written at the lines
+	//starting with y and lasting the page.
+	for (y = ystart; y < yend; y++) {
+		//Find start and end of changed data
+		chstart = -1;
+		for (x = 0; x < xres; x++) {
+			if (buffer[x] != oldbuffer[x]) {
+				oldbuffer[x] = buffer[x];
+				if (chstart == -1)
+					chstart = x;
+				chend=x;
+			}
+		}
+		if (chstart!=-1) {
+			/* Something changed this line! chstart and chend 
+			 * contain start and end x-coords. */
+			ili9341_set_window(ili, chstart, y, chend, y);
+			ili9341_write_pixels(ili, &oldbuffer[chstart],
+					     chend - chstart + 1);
+			ili9341_cursor_hit(ili, chstart, chend, y);
+			ili9341_trace(ili, ILI9341_TRACE_FLUSH, chstart, y,
+				      chend - chstart + 1, 1,
+				      (chend - chstart + 1) *
+				      ili->variant->bus_bpp);
+		}
+		buffer += xres;
+		oldbuffer += xres;
+	}
+}
+
+/* Send the complete framebuffer as a single window. Used for the first frame
+ * after bring-up, where every pixel is new and per-line diffing is wasted. */
+static void ili9341_copy_all(struct ili9341 *ili)
+{
+	struct fb_info *info = ili->info;
+	unsigned short *oldbuffer = ili->pages[0].oldbuffer;
+	unsigned int len = info->var.xres * info->var.yres;
+	unsigned int i;
+
+	for (i = 0; i < BITS_TO_LONGS(ili->pages_count); i++)
+		xchg(&ili->dirty[i], 0);
+	memcpy(oldbuffer, ili->pages[0].buffer, len * 2);
+
+	ili9341_set_window(ili, 0, 0, info->var.xres - 1, info->var.yres - 1);
+	ili9341_write_pixels(ili, oldbuffer, len);
+	ili9341_trace(ili, ILI9341_TRACE_FLUSH, 0, 0, info->var.xres,
+		      info->var.yres, len * ili->variant->bus_bpp);
+}
+
+static unsigned short ili9341_page_prio(struct ili9341 *ili,
+					unsigned int index)
+{
+	unsigned int ystart, yend;
+
+	ili9341_page_lines(ili, index, &ystart, &yend);
+	return ystart < ili->prio_y1 && yend > ili->prio_y0;
+}
+
+static int ili9341_flush_cmp(const void *a, const void *b)
+{
+	const struct ili9341_flush_entry *ea = a, *eb = b;
+
+	if (ea->prio != eb->prio)
+		return eb->prio - ea->prio;
+	/* Most recently damaged first. */
+	if (ea->stamp != eb->stamp)
+		return eb->stamp > ea->stamp ? 1 : -1;
+	return ea->index - eb->index;
+}
+
+/* Send all dirty pages, priority area first and then by recency. A page that
+ * is damaged again after the flush picked it up is skipped: the pixels it
+ * holds now are already stale and the new damage has queued it for the next
+ * flush anyway. ILI9341_MAX_DEFER keeps a page that is redrawn continuously
+ * from never being sent.
+ *
+ * Only damage that reaches ili9341_damage_page() while a flush runs can
+ * make a page stale, which in practice means fbcon and fb_write. An mmap
+ * writer that faults during a deferred io flush blocks on the defio lock
+ * until the flush is over, and scan and flip mode keep no stamps, so
+ * userspace redraws are never cancelled mid-flush. */
+static bool ili9341_page_stale(struct ili9341 *ili,
+			       const struct ili9341_flush_entry *entry)
+{
+	struct ili9341_page *page = &ili->pages[entry->index];
+
+	/* a flipped frame goes out whole, or it would tear */
+	if (flip)
+		return false;
+	if (READ_ONCE(page->stamp) != entry->stamp &&
+	    page->deferred < ILI9341_MAX_DEFER) {
+		page->deferred++;
+		ili->stale_skipped++;
+		return true;
+	}
+	page->deferred = 0;
+	return false;
+}
+
+static void ili9341_flush_bands(struct ili9341 *ili,
+				const struct ili9341_flush_entry *order,
+				unsigned int n);
+
+static void ili9341_flush(struct ili9341 *ili)
+{
+	struct ili9341_flush_entry *order = ili->flush_order;
+	unsigned long bits;
+	unsigned int i, m, w, n = 0;
+	unsigned int ystart, yend, lines = 0;
+
+	for (w = 0; w < BITS_TO_LONGS(ili->pages_count); w++) {
+		/* Full barrier: stamps read below are at least as new as
+		 * the bits we took. */
+		bits = xchg(&ili->dirty[w], 0);
+		while (bits) {
+			i = w * BITS_PER_LONG + __ffs(bits);
+			bits &= bits - 1;
+			order[n].index = i;
+			order[n].stamp = READ_ONCE(ili->pages[i].stamp);
+			order[n].prio = ili9341_page_prio(ili, i);
+			n++;
+		}
+	}
+
+	sort(order, n, sizeof(*order), ili9341_flush_cmp, NULL);
+
+	for (i = 0; i < n; i++) {
+		ili9341_page_lines(ili, order[i].index, &ystart, &yend);
+		lines += yend - ystart;
+	}
+
+	if (parallel_lines && lines >= parallel_lines &&
+	    ili->bands_count > 1) {
+		for (i = 0, m = 0; i < n; i++)
+			if (!ili9341_page_stale(ili, &order[i]))
+				order[m++] = order[i];
+		ili9341_flush_bands(ili, order, m);
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (ili9341_page_stale(ili, &order[i]))
+			continue;
+		ili9341_copy(ili, order[i].index);
+	}
+}
+
+static void ili9341_flush_bands(struct ili9341 *ili,
+				const struct ili9341_flush_entry *order,
+				unsigned int n)
+{
+	unsigned int xres = ili->info->var.xres;
+	unsigned int bpp = ili->variant->bus_bpp;
+	unsigned int i, b, y, ystart, yend;
+	struct ili9341_span *span;
+
+	for (i = 0; i < n; i++) {
+		ili9341_page_lines(ili, order[i].index, &ystart, &yend);
+		memset(ili->line_dirty + ystart, 1, yend - ystart);
+	}
+
+	/* Band 0 runs here, the rest on other CPUs. */
+	for (b = 1; b < ili->bands_count; b++)
+		queue_work(system_unbound_wq, &ili->bands[b].work);
+	ili9341_band_diff(ili, ili->bands[0].y0, ili->bands[0].y1);
+	for (b = 1; b < ili->bands_count; b++)
+		flush_work(&ili->bands[b].work);
+
+	for (i = 0; i < n; i++) {
+		ili9341_page_lines(ili, order[i].index, &ystart, &yend);
+		for (y = ystart; y < yend; y++) {
+			span = &ili->spans[y];
+			if (span->x0 < 0)
+				continue;
+			ili9341_set_window(ili, span->x0, y, span->x1, y);
+			ili->bus->pixels(ili, ili->packbuf +
+					 (y * xres + span->x0) * bpp,
+					 (span->x1 - span->x0 + 1) * bpp);
+			ili->tx_bytes += (span->x1 - span->x0 + 1) * bpp;
+			ili9341_cursor_hit(ili, span->x0, span->x1, y);
+			ili9341_trace(ili, ILI9341_TRACE_FLUSH, span->x0, y,
+				      span->x1 - span->x0 + 1, 1,
+				      (span->x1 - span->x0 + 1) * bpp);
+			/* lines shared by two pages go out once */
+			span->x0 = -1;
+		}
+	}
+	ili->parallel_flushes++;
+}
+
+/* Kick the flush worker: the deferred io work, or in scan mode the scan
+ * work (which is then just run early). */
+static void ili9341_schedule_flush(struct ili9341 *ili, unsigned long delay)
+{
+	if (ili->info->fbdefio)
+		schedule_delayed_work(&ili->info->deferred_work, delay);
+	else if (flip)
+		schedule_delayed_work(&ili->flip_work, delay);
+	else
+		schedule_delayed_work(&ili->scan_work, delay);
+}
+
+/* Flush now, even if a flush is already pending for later. */
+static void ili9341_kick_flush(struct ili9341 *ili)
+{
+	if (ili->info->fbdefio)
+		mod_delayed_work(system_wq, &ili->info->deferred_work, 0);
+	else if (flip)
+		mod_delayed_work(system_wq, &ili->flip_work, 0);
+	else
+		mod_delayed_work(system_wq, &ili->scan_work, 0);
+}
+
+static void ili9341_update_all(struct ili9341 *ili)
+{
+	WRITE_ONCE(ili->full_update, 1);
+	ili9341_schedule_flush(ili, ILI9341_DEFIO_DELAY);
+}
+
+/* Send one cursor cell to the panel. Hidden, the cell is restored from the
+ * framebuffer, which is also copied into the shadow so the diff stays in
+ * step with what was sent. Shown, it is composited the way soft_cursor
+ * would draw it, without touching either buffer. */
+static void ili9341_cursor_send(struct ili9341 *ili,
+				const struct ili9341_cursor_state *cs, bool show)
+{
+	struct ili9341_cursor *cursor = &ili->cursor;
+	unsigned int xres = ili->info->var.xres;
+	unsigned short *fb = ili->pages[0].buffer;
+	unsigned short *shadow = ili->pages[0].oldbuffer;
+	unsigned int pitch = DIV_ROUND_UP(cs->w, 8);
+	unsigned int w, h, r, c, i, off;
+	u16 *pix = cursor->pix;
+	u8 bits;
+
+	w = min_t(unsigned int, cs->w, xres - cs->x);
+	h = min_t(unsigned int, cs->h, ili->info->var.yres - cs->y);
+	if (cs->x >= xres || cs->y >= ili->info->var.yres || !w || !h)
+		return;
+
+	for (r = 0; r < h; r++) {
+		off = (cs->y + r) * xres + cs->x;
+		for (c = 0; c < w; c++, pix++) {
+			if (!show) {
+				*pix = fb[off + c];
+				shadow[off + c] = *pix;
+				continue;
+			}
+			i = r * pitch + c / 8;
+			bits = cs->image[i];
+			if (cs->enable)
+				bits = cs->rop == ROP_XOR ? bits ^ cs->mask[i] :
+							    bits & cs->mask[i];
+			*pix = (bits & (0x80 >> (c % 8))) ? cs->fg : cs->bg;
+		}
+	}
+
+	ili9341_set_window(ili, cs->x, cs->y, cs->x + w - 1, cs->y + h - 1);
+	ili9341_write_pixels(ili, cursor->pix, w * h);
+	cursor->updates++;
+	cursor->bytes += w * h * ili->variant->bus_bpp;
+}
+
+/* Fences up to seq are on the panel. */
+static void ili9341_fence_signal(struct ili9341 *ili, u64 seq)
+{
+	struct ili9341_fence *f;
+	unsigned long flags;
+	unsigned int i;
+
+	WRITE_ONCE(ili->fence_done, seq);
+	wake_up_all(&ili->fence_wait);
+
+	spin_lock_irqsave(&ili->fence_lock, flags);
+	for (i = 0; i < ILI9341_MAX_FENCES; i++) {
+		f = &ili->fences[i];
+		if (f->ctx && f->seq <= seq) {
+			eventfd_signal(f->ctx, 1);
+			eventfd_ctx_put(f->ctx);
+			f->ctx = NULL;
+		}
+	}
+	spin_unlock_irqrestore(&ili->fence_lock, flags);
+}
+
+/* Bus throughput, from flushes big enough that commands don't dominate. */
+static void ili9341_flush_rate(struct ili9341 *ili, u64 bytes, s64 ns)
+{
+	u32 rate;
+
+	ili->last_flush_us = div_u64(ns, NSEC_PER_USEC);
+	if (bytes < BLOCKLEN || ns <= 0)
+		return;
+
+	rate = div64_u64(bytes * NSEC_PER_SEC, ns);
+	/* average over the last few big flushes */
+	ili->bytes_per_sec = ili->bytes_per_sec ?
+			     (ili->bytes_per_sec * 3 + rate) / 4 : rate;
+}
+
+/* Send whatever is marked in ili->dirty. */
+static void ili9341_do_flush(struct ili9341 *ili)
+{
+	ktime_t start;
+	u32 seq;
+	u64 fence, tx_bytes;
+	u32 skipped;
+
+	/* Wakes the panel (SLPOUT + shadow re-upload) if it went idle. */
+	pm_runtime_get_sync(ili->dev);
+	mutex_lock(&ili->lock);
+
+	/* Panel is still being brought up; keep the damage, the init work
+	 * will send it along with the first full frame. The same goes while
+	 * the stream device owns the panel; releasing it forces a full frame. */
+	if (!ili->initialised || ili->streaming)
+		goto out;
+
+	ili9341_trace(ili, ILI9341_TRACE_FLUSH_BEGIN, 0, 0, 0, 0, 0);
+	start = ktime_get();
+	seq = ili->flip_seq;
+	/* Read before the framebuffer is: whatever was drawn before a fence
+	 * was submitted is seen by this flush. */
+	fence = atomic64_read(&ili->fence_submitted);
+	smp_mb();
+	skipped = ili->stale_skipped;
+	tx_bytes = ili->tx_bytes;
+	ili9341_slice_begin(ili);
+	ili->cursor.hit = false;
+	if (xchg(&ili->full_update, 0)) {
+		ili9341_copy_all(ili);
+		ili->cursor.hit = ili->cursor.drawn.enable;
+	} else {
+		ili9341_flush(ili);
+	}
+	/* the flush drew over the cursor cell */
+	if (ili->cursor.hit)
+		ili9341_cursor_send(ili, &ili->cursor.drawn, true);
+	ili9341_slice_end(ili);
+	ili9341_flush_rate(ili, ili->tx_bytes - tx_bytes,
+			   ktime_to_ns(ktime_sub(ktime_get(), start)));
+	ili->flush_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	ili->flushes++;
+
+	/* Deferred pages are covered by a later flush, and so are fences. */
+	if (ili->stale_skipped == skipped && fence != ili->fence_done)
+		ili9341_fence_signal(ili, fence);
+
+	if (ili->flip_done != seq) {
+		WRITE_ONCE(ili->flip_done, seq);
+		wake_up_all(&ili->flip_wait);
+	}
+
+out:
+	mutex_unlock(&ili->lock);
+	pm_runtime_mark_last_busy(ili->dev);
+	pm_runtime_put_autosuspend(ili->dev);
+}
+
+static void ili9341_update(struct fb_info *info, struct list_head *pagelist)
+{
+	struct ili9341 *ili = (struct ili9341 *)info->par;
+	struct page *page;
+	unsigned long stamp = ili9341_damage_stamp(ili);
+
+	/* We can be called because of pagefaults (mmap'ed framebuffer, pages
+	 * returned in *pagelist) or because of kernel activity
+	 * (bit set in ili->dirty). Add the former to the list of the latter.
+	 * Defio does not say when each page was written, so they all share
+	 * one stamp and go out in index order behind the priority area. */
+	list_for_each_entry(page, pagelist, lru) {
+		ili9341_trace(ili, ILI9341_TRACE_PAGE, page->index, 0, 0, 0, 0);
+		ili9341_damage_page(ili, page->index, stamp);
+		ili->defio_pages++;
+	}
+
+	ili9341_do_flush(ili);
+}
+
+/* Scan mode: the framebuffer is mapped as plain memory, so writes cost no
+ * page faults, and this timer driven work diffs every line against the
+ * shadow scan_hz times a second instead. A tick where the framebuffer
+ * equals the shadow costs one memcmp and leaves the panel to go idle. */
+static void ili9341_scan_work(struct work_struct *work)
+{
+	struct ili9341 *ili = container_of(to_delayed_work(work),
+					   struct ili9341, scan_work);
+	struct fb_info *info = ili->info;
+	unsigned long stamp;
+	unsigned int i;
+	ktime_t start = ktime_get();
+
+	/* Nothing drawn: no flush, so the panel is not woken and its idle
+	 * timer keeps running. A pending fence still takes a flush. */
+	if (!READ_ONCE(ili->full_update) &&
+	    atomic64_read(&ili->fence_submitted) == READ_ONCE(ili->fence_done) &&
+	    !memcmp(ili->pages[0].oldbuffer, ili->pages[0].buffer,
+		    info->var.xres * info->var.yres * 2))
+		goto out;
+
+	stamp = ili9341_damage_stamp(ili);
+	for (i = 0; i < ili->pages_count; i++)
+		ili9341_damage_page(ili, i, stamp);
+	ili9341_do_flush(ili);
+
+out:
+	ili->scan_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	ili->scans++;
+	schedule_delayed_work(&ili->scan_work, max(HZ / scan_hz, 1U));
+}
+
+/* Flip mode. The pages follow the front buffer, so the flush engine diffs
+ * the new front buffer against the shadow, which holds the previous front
+ * buffer once the last flip has gone out: no extra copy, and the back
+ * buffer can be redrawn as soon as the pan returns. Nothing is write
+ * protected; a pan marks the whole frame and FBIO_WAITFORVSYNC waits for
+ * it to reach the panel. */
+static void ili9341_flip_work(struct work_struct *work)
+{
+	struct ili9341 *ili = container_of(to_delayed_work(work),
+					   struct ili9341, flip_work);
+
+	ili9341_do_flush(ili);
+}
+
+static int ili9341_pan_display(struct fb_var_screeninfo *var,
+			       struct fb_info *info)
+{
+	struct ili9341 *ili = (struct ili9341 *)info->par;
+	unsigned long stamp;
+	long delta;
+	unsigned int i;
+
+	if (var->xoffset || (var->yoffset && var->yoffset != info->var.yres))
+		return -EINVAL;
+
+	/* Taking the lock lets a flush in progress finish its frame. */
+	mutex_lock(&ili->lock);
+	delta = ((long)var->yoffset - ili->front_y) * info->var.xres;
+	for (i = 0; i < ili->pages_count; i++)
+		ili->pages[i].buffer += delta;
+	ili->front_y = var->yoffset;
+	ili->flip_seq++;
+	ili->flips++;
+
+	stamp = ili9341_damage_stamp(ili);
+	for (i = 0; i < ili->pages_count; i++)
+		ili9341_damage_page(ili, i, stamp);
+	mutex_unlock(&ili->lock);
+
+	ili9341_schedule_flush(ili, 0);
+	return 0;
+}
+
+static int ili9341_wait_flip(struct ili9341 *ili)
+{
+	u32 seq = READ_ONCE(ili->flip_seq);
+
+	return wait_event_interruptible(ili->flip_wait,
+			(s32)(READ_ONCE(ili->flip_done) - seq) >= 0);
+}
+
+static inline __u32 CNVT_TOHW(__u32 val, __u32 width)
+{
+	return ((val<<width) + 0x7FFF - val)>>16;
 }
 
 
@@ -325,357 +1693,1767 @@ static int ili9341_setcolreg(unsigned regno,
 			u32 *pal = info->pseudo_palette;
 			u32 value;
 
-			red = CNVT_TOHW(red, info->var.red.length);
-			green = CNVT_TOHW(green, info->var.green.length);
-			blue = CNVT_TOHW(blue, info->var.blue.length);
-			transp = CNVT_TOHW(transp, info->var.transp.length);
+			red = CNVT_TOHW(red, info->var.red.length);
+			green = CNVT_TOHW(green, info->var.green.length);
+			blue = CNVT_TOHW(blue, info->var.blue.length);
+			transp = CNVT_TOHW(transp, info->var.transp.length);
+
+			value = (red << info->var.red.offset) |
+				(green << info->var.green.offset) |
+				(blue << info->var.blue.offset) |
+				(transp << info->var.transp.offset);
+
+			pal[regno] = value;
+			ret = 0;
+		}
+		break;
+	case FB_VISUAL_STATIC_PSEUDOCOLOR:
+	case FB_VISUAL_PSEUDOCOLOR:
+		break;
+	}
+	return ret;
+}
+
+static int ili9341_power(struct ili9341 *lcd, int power);
+
+static int ili9341_blank(int blank_mode, struct fb_info *info)
+{
+	struct ili9341 *ili = (struct ili9341 *)info->par;
+	int ret;
+
+	ret = ili9341_power(ili, blank_mode);
+	if (ret)
+		return ret;
+
+	if (blank_mode == FB_BLANK_UNBLANK)
+		ili->backlight=1;
+	else
+		ili->backlight=0;
+	/* Item->backlight won't take effect until the LCD is written to. Force that
+	 * by dirty'ing a page. */
+	ili9341_damage_page(ili, 0, ili9341_damage_stamp(ili));
+	ili9341_schedule_flush(ili, 0);
+	return 0;
+}
+
+static void ili9341_touch(struct fb_info *info, int x, int y, int w, int h) 
+{
+	struct ili9341 *ili = (struct ili9341 *)info->par;
+	unsigned int i, ystart, yend;
+	unsigned long stamp;
+
+	ili9341_trace(ili, ILI9341_TRACE_TOUCH, x, y, w, h, 0);
+	stamp = ili9341_damage_stamp(ili);
+	/* Touch the pages the y-range hits, so the deferred io will update them. */
+	for (i=0; i<ili->pages_count; i++) {
+		ili9341_page_lines(ili, i, &ystart, &yend);
+		if (!((y+h)<ystart || y>yend)) {
+			ili9341_damage_page(ili, i, stamp);
+		}
+	}
+	/* Schedule the deferred IO to kick in after a delay.*/
+	ili9341_schedule_flush(ili, ILI9341_DEFIO_DELAY);
+}
+
+static void ili9341_fillrect(struct fb_info *p, const struct fb_fillrect *rect) 
+{
+	sys_fillrect(p, rect);
+	ili9341_touch(p, rect->dx, rect->dy, rect->width, rect->height);
+}
+
+static void ili9341_imageblit(struct fb_info *p, const struct fb_image *image) 
+{
+	sys_imageblit(p, image);
+	ili9341_touch(p, image->dx, image->dy, image->width, image->height);
+}
+
+static void ili9341_copyarea(struct fb_info *p, const struct fb_copyarea *area) 
+{
+	sys_copyarea(p, area);
+	ili9341_touch(p, area->dx, area->dy, area->width, area->height);
+}
+
+static ssize_t ili9341_write(struct fb_info *p, const char __user *buf, 
+				size_t count, loff_t *ppos) 
+{
+	ssize_t res;
+	res = fb_sys_write(p, buf, count, ppos);
+	ili9341_touch(p, 0, 0, p->var.xres, p->var.yres);
+	return res;
+}
+
+
+/* Cursor blinks and moves go straight to the panel as a single cell, so an
+ * idle console sends a few hundred bytes per blink and never runs the diff.
+ * fbcon calls this with the console lock held, possibly in atomic context;
+ * the state is recorded and the transfer done from a work item. */
+static int ili9341_cursor(struct fb_info *info, struct fb_cursor *cursor)
+{
+	struct ili9341 *ili = (struct ili9341 *)info->par;
+	struct ili9341_cursor_state *next = &ili->cursor.next;
+	const u32 *pal = info->pseudo_palette;
+	unsigned long flags;
+	unsigned int size;
+
+	if (cursor->image.width > ILI9341_CURSOR_MAX ||
+	    cursor->image.height > ILI9341_CURSOR_MAX ||
+	    cursor->image.depth != 1)
+		return -EINVAL;	/* fbcon falls back to soft_cursor */
+
+	size = DIV_ROUND_UP(cursor->image.width, 8) * cursor->image.height;
+
+	spin_lock_irqsave(&ili->cursor.lock, flags);
+	next->x = cursor->image.dx;
+	next->y = cursor->image.dy;
+	next->w = cursor->image.width;
+	next->h = cursor->image.height;
+	next->enable = cursor->enable;
+	next->rop = cursor->rop;
+	if (cursor->image.fg_color < 16 && cursor->image.bg_color < 16) {
+		next->fg = pal[cursor->image.fg_color];
+		next->bg = pal[cursor->image.bg_color];
+	}
+	if (cursor->image.data)
+		memcpy(next->image, cursor->image.data, size);
+	if (cursor->mask)
+		memcpy(next->mask, cursor->mask, size);
+	spin_unlock_irqrestore(&ili->cursor.lock, flags);
+
+	schedule_work(&ili->cursor.work);
+	return 0;
+}
 
-			value = (red << info->var.red.offset) |
-				(green << info->var.green.offset) |
-				(blue << info->var.blue.offset) |
-				(transp << info->var.transp.offset);
+static void ili9341_cursor_work(struct work_struct *work)
+{
+	struct ili9341 *ili = container_of(work, struct ili9341, cursor.work);
+	struct ili9341_cursor_state *drawn = &ili->cursor.drawn;
+	struct ili9341_cursor_state next;
+	unsigned long flags;
+
+	/* A blink is not worth waking a sleeping panel for, nor keeping it
+	 * awake: only hold it while it is active, and leave the idle timer
+	 * alone. Resume drops the cursor and the next blink redraws it. */
+	pm_runtime_get_noresume(ili->dev);
+	if (!pm_runtime_active(ili->dev)) {
+		pm_runtime_put_noidle(ili->dev);
+		return;
+	}
 
-			pal[regno] = value;
+	spin_lock_irqsave(&ili->cursor.lock, flags);
+	next = ili->cursor.next;
+	spin_unlock_irqrestore(&ili->cursor.lock, flags);
+
+	mutex_lock(&ili->lock);
+	if (!ili->initialised || ili->streaming)
+		goto out;
+
+	ili9341_slice_begin(ili);
+	if (drawn->enable && (!next.enable || next.x != drawn->x ||
+			      next.y != drawn->y || next.w != drawn->w ||
+			      next.h != drawn->h))
+		ili9341_cursor_send(ili, drawn, false);
+	if (next.enable)
+		ili9341_cursor_send(ili, &next, true);
+	ili9341_slice_end(ili);
+	*drawn = next;
+out:
+	mutex_unlock(&ili->lock);
+	pm_runtime_put_autosuspend(ili->dev);
+}
+
+/* Fences. In deferred io mode a page written before SUBMIT is either in
+ * the pagelist of the next update, or its fault waited for the update in
+ * progress to finish, which then read the fence counter before it was
+ * bumped; so a fence never completes ahead of the pixels it covers. */
+static int ili9341_fence_eventfd(struct ili9341 *ili,
+				 const struct ili9341_fence_eventfd *req)
+{
+	struct eventfd_ctx *ctx;
+	unsigned long flags;
+	unsigned int i;
+	int ret = -EBUSY;
+
+	ctx = eventfd_ctx_fdget(req->fd);
+	if (IS_ERR(ctx))
+		return PTR_ERR(ctx);
+
+	/* already done: signal straight away */
+	if (req->seq <= READ_ONCE(ili->fence_done)) {
+		eventfd_signal(ctx, 1);
+		eventfd_ctx_put(ctx);
+		return 0;
+	}
+
+	spin_lock_irqsave(&ili->fence_lock, flags);
+	for (i = 0; i < ILI9341_MAX_FENCES; i++) {
+		if (!ili->fences[i].ctx) {
+			ili->fences[i].ctx = ctx;
+			ili->fences[i].seq = req->seq;
 			ret = 0;
+			break;
 		}
-		break;
-	case FB_VISUAL_STATIC_PSEUDOCOLOR:
-	case FB_VISUAL_PSEUDOCOLOR:
-		break;
 	}
+	spin_unlock_irqrestore(&ili->fence_lock, flags);
+
+	if (ret)
+		eventfd_ctx_put(ctx);
+	else if (req->seq <= READ_ONCE(ili->fence_done))
+		ili9341_fence_signal(ili, READ_ONCE(ili->fence_done));
 	return ret;
 }
 
-static int ili9341_blank(int blank_mode, struct fb_info *info)
+static void ili9341_fence_info(struct ili9341 *ili,
+			       struct ili9341_fence_info *fi)
+{
+	struct fb_info *info = ili->info;
+	u32 rate = ili->bytes_per_sec;
+
+	/* nothing measured yet: assume the bus runs at its clock */
+	if (!rate && ili->bus_hz)
+		rate = ili->bus_hz / 8;
+
+	memset(fi, 0, sizeof(*fi));
+	fi->submitted = atomic64_read(&ili->fence_submitted);
+	fi->completed = READ_ONCE(ili->fence_done);
+	fi->frame_bytes = info->var.xres * info->var.yres *
+			  ili->variant->bus_bpp;
+	fi->bytes_per_sec = rate;
+	if (rate)
+		fi->frame_budget_us = div_u64((u64)fi->frame_bytes *
+					      USEC_PER_SEC, rate);
+	fi->last_flush_us = ili->last_flush_us;
+}
+
+static int ili9341_ioctl(struct fb_info *info, unsigned int cmd,
+			 unsigned long arg)
 {
 	struct ili9341 *ili = (struct ili9341 *)info->par;
-	if (blank_mode == FB_BLANK_UNBLANK)
-		ili->backlight=1;
+	void __user *argp = (void __user *)arg;
+	struct ili9341_fence_eventfd efd;
+	struct ili9341_fence_info fi;
+	struct ili9341_rect rect;
+	u64 seq;
+
+	switch (cmd) {
+	case ILI9341_IOCTL_SET_PRIORITY:
+		if (copy_from_user(&rect, argp, sizeof(rect)))
+			return -EFAULT;
+		ili->prio_y0 = rect.y;
+		ili->prio_y1 = rect.h ? rect.y + rect.h : 0;
+		return 0;
+	case FBIO_WAITFORVSYNC:
+		if (!flip)
+			return -ENOTTY;
+		return ili9341_wait_flip(ili);
+	case ILI9341_IOCTL_SUBMIT:
+		/* No flush would run to complete it: the panel is still being
+		 * brought up, or the stream device owns it. */
+		mutex_lock(&ili->lock);
+		if (!ili->initialised || ili->streaming) {
+			mutex_unlock(&ili->lock);
+			return -EBUSY;
+		}
+		smp_mb();
+		seq = atomic64_inc_return(&ili->fence_submitted);
+		mutex_unlock(&ili->lock);
+		ili9341_kick_flush(ili);
+		return put_user(seq, (__u64 __user *)argp);
+	case ILI9341_IOCTL_WAIT_FENCE:
+		if (get_user(seq, (__u64 __user *)argp))
+			return -EFAULT;
+		if (seq > atomic64_read(&ili->fence_submitted))
+			return -EINVAL;
+		return wait_event_interruptible(ili->fence_wait,
+				READ_ONCE(ili->fence_done) >= seq);
+	case ILI9341_IOCTL_FENCE_EVENTFD:
+		if (copy_from_user(&efd, argp, sizeof(efd)))
+			return -EFAULT;
+		if (efd.seq > atomic64_read(&ili->fence_submitted))
+			return -EINVAL;
+		return ili9341_fence_eventfd(ili, &efd);
+	case ILI9341_IOCTL_FENCE_INFO:
+		ili9341_fence_info(ili, &fi);
+		if (copy_to_user(argp, &fi, sizeof(fi)))
+			return -EFAULT;
+		return 0;
+	}
+
+	return -ENOTTY;
+}
+
+/* Scan and flip mode mmap: plain writable mapping of the vmalloc'ed framebuffer,
+ * no write protection and no faults after the first touch. */
+static int ili9341_mmap(struct fb_info *info, struct vm_area_struct *vma)
+{
+	return remap_vmalloc_range(vma, (void *)info->fix.smem_start,
+				   vma->vm_pgoff);
+}
+
+static struct fb_ops ili9341_fbops = {
+	.owner        = THIS_MODULE,
+	.fb_read      = fb_sys_read,
+	.fb_write     = ili9341_write,
+	.fb_fillrect  = ili9341_fillrect,
+	.fb_copyarea  = ili9341_copyarea,
+	.fb_imageblit = ili9341_imageblit,
+	.fb_setcolreg	= ili9341_setcolreg,
+	.fb_blank	= ili9341_blank,
+	.fb_ioctl	= ili9341_ioctl,
+	.fb_cursor	= ili9341_cursor,
+};
+
+/* Geometry is filled in from the variant at probe time. */
+static const struct fb_fix_screeninfo ili9341_fix = {
+	.id          = "ILI9341",
+	.type        = FB_TYPE_PACKED_PIXELS,
+	.visual      = FB_VISUAL_TRUECOLOR,
+	.accel       = FB_ACCEL_NONE,
+};
+
+static const struct fb_var_screeninfo ili9341_var = {
+	.bits_per_pixel	= 16,
+	/* Pixel format is RGB565 packed */
+	.red		= {11, 5, 0},
+	.green		= {5, 6, 0},
+	.blue		= {0, 5, 0},
+	.activate	= FB_ACTIVATE_NOW,
+	.vmode		= FB_VMODE_NONINTERLACED,
+};
+
+static struct fb_deferred_io ili9341_defio = {
+	.delay          = ILI9341_DEFIO_DELAY,
+	.deferred_io    = &ili9341_update,
+};
+
+/* Streaming mode: whole frames written to /dev/fbN-stream go out as one
+ * RAMWR burst each, without diffing. The window covers the full panel and is
+ * set once; every frame after that only needs RAMWR to rewind the GRAM
+ * pointer. If the writer is faster than the bus the frame waiting for
+ * transmission is replaced, so the panel always gets the newest frame. */
+static void ili9341_stream_work(struct work_struct *work)
+{
+	struct ili9341_stream *st = container_of(work, struct ili9341_stream,
+						 work);
+	struct ili9341 *ili = container_of(st, struct ili9341, stream);
+	struct fb_info *info = ili->info;
+	unsigned int len = info->var.xres * info->var.yres;
+	s64 us;
+	int idx;
+
+	pm_runtime_get_sync(ili->dev);
+	mutex_lock(&ili->lock);
+
+	/* Panel is still being brought up; the newest frame stays pending and
+	 * the init work sends it once the panel is ready. */
+	if (!ili->initialised)
+		goto out;
+
+	ili9341_slice_begin(ili);
+	for (;;) {
+		spin_lock(&st->lock);
+		idx = st->pending;
+		st->pending = -1;
+		st->sending = idx;
+		spin_unlock(&st->lock);
+		if (idx < 0)
+			break;
+
+		if (!st->window_set) {
+			ili9341_set_window(ili, 0, 0, info->var.xres - 1,
+					   info->var.yres - 1);
+			st->window_set = 1;
+		} else {
+			ili9341_send_command(ili, ILI9341_RAMWR);
+		}
+		ili9341_write_pixels(ili, st->slot[idx], len);
+
+		st->frames++;
+		st->fps_frames++;
+		us = ktime_us_delta(ktime_get(), st->fps_start);
+		if (us >= USEC_PER_SEC) {
+			st->fps = div64_s64((s64)st->fps_frames * USEC_PER_SEC,
+					    us);
+			st->fps_frames = 0;
+			st->fps_start = ktime_get();
+		}
+	}
+	ili9341_slice_end(ili);
+
+	spin_lock(&st->lock);
+	st->sending = -1;
+	spin_unlock(&st->lock);
+
+out:
+	mutex_unlock(&ili->lock);
+	pm_runtime_mark_last_busy(ili->dev);
+	pm_runtime_put_autosuspend(ili->dev);
+}
+
+static int ili9341_stream_open(struct inode *inode, struct file *file)
+{
+	struct ili9341_stream *st = container_of(file->private_data,
+						 struct ili9341_stream, misc);
+	struct ili9341 *ili = container_of(st, struct ili9341, stream);
+	struct fb_info *info = ili->info;
+	unsigned int len = info->var.xres * info->var.yres * 2;
+	int i;
+
+	if (test_and_set_bit(0, &st->busy))
+		return -EBUSY;
+
+	for (i = 0; i < ILI9341_STREAM_SLOTS; i++) {
+		st->slot[i] = vmalloc(len);
+		if (!st->slot[i])
+			goto out_free;
+	}
+	st->pending = -1;
+	st->sending = -1;
+	st->window_set = 0;
+	st->fps_frames = 0;
+	st->fps_start = ktime_get();
+
+	mutex_lock(&ili->lock);
+	ili->streaming = 1;
+	mutex_unlock(&ili->lock);
+
+	return 0;
+
+out_free:
+	while (i--)
+		vfree(st->slot[i]);
+	clear_bit(0, &st->busy);
+	return -ENOMEM;
+}
+
+static ssize_t ili9341_stream_write(struct file *file, const char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	struct ili9341_stream *st = container_of(file->private_data,
+						 struct ili9341_stream, misc);
+	struct ili9341 *ili = container_of(st, struct ili9341, stream);
+	struct fb_info *info = ili->info;
+	unsigned int len = info->var.xres * info->var.yres * 2;
+	int idx;
+
+	if (count != len)
+		return -EINVAL;
+
+	/* Only one writer, so the slot that is neither pending nor on the
+	 * wire is ours to fill. */
+	spin_lock(&st->lock);
+	for (idx = 0; idx < ILI9341_STREAM_SLOTS; idx++)
+		if (idx != st->pending && idx != st->sending)
+			break;
+	spin_unlock(&st->lock);
+
+	if (copy_from_user(st->slot[idx], buf, len))
+		return -EFAULT;
+
+	spin_lock(&st->lock);
+	if (st->pending >= 0)
+		st->dropped++;
+	st->pending = idx;
+	spin_unlock(&st->lock);
+
+	schedule_work(&st->work);
+
+	return count;
+}
+
+static int ili9341_stream_release(struct inode *inode, struct file *file)
+{
+	struct ili9341_stream *st = container_of(file->private_data,
+						 struct ili9341_stream, misc);
+	struct ili9341 *ili = container_of(st, struct ili9341, stream);
+	int i;
+
+	flush_work(&st->work);
+
+	mutex_lock(&ili->lock);
+	ili->streaming = 0;
+	mutex_unlock(&ili->lock);
+	/* The panel shows the last streamed frame; put the framebuffer back. */
+	ili9341_update_all(ili);
+
+	for (i = 0; i < ILI9341_STREAM_SLOTS; i++)
+		vfree(st->slot[i]);
+	clear_bit(0, &st->busy);
+	wake_up(&st->release_wait);
+
+	return 0;
+}
+
+static const struct file_operations ili9341_stream_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ili9341_stream_open,
+	.write		= ili9341_stream_write,
+	.release	= ili9341_stream_release,
+	.llseek		= no_llseek,
+};
+
+static int ili9341_stream_init(struct ili9341 *ili)
+{
+	struct ili9341_stream *st = &ili->stream;
+
+	spin_lock_init(&st->lock);
+	init_waitqueue_head(&st->release_wait);
+	INIT_WORK(&st->work, ili9341_stream_work);
+	snprintf(st->name, sizeof(st->name), "fb%d-stream", ili->info->node);
+	st->misc.minor = MISC_DYNAMIC_MINOR;
+	st->misc.name = st->name;
+	st->misc.fops = &ili9341_stream_fops;
+	st->misc.mode = 0220;
+	st->misc.parent = ili->dev;
+
+	return misc_register(&st->misc);
+}
+
+/* misc_deregister() only stops new opens. A writer that still holds the
+ * device works on ili, so wait for its release before tearing down. */
+static void ili9341_stream_exit(struct ili9341 *ili)
+{
+	struct ili9341_stream *st = &ili->stream;
+
+	misc_deregister(&st->misc);
+	if (test_bit(0, &st->busy))
+		dev_info(ili->dev, "waiting for %s to be closed\n", st->name);
+	wait_event(st->release_wait, !test_bit(0, &st->busy));
+	cancel_work_sync(&st->work);
+}
+
+void ili9341_set_orientation(struct ili9341 *ili, uint8_t flags)
+{
+	uint8_t madctl = ili->variant->madctl;
+
+	if (flags & ILI9341_FLIP_X) {
+		madctl &= ~(1 << 6);
+	}
+
+	if (flags & ILI9341_FLIP_Y) {
+		madctl |= 1 << 7;
+	}
+
+	if (flags & ILI9341_SWITCH_XY) {
+		madctl |= 1 << 5;
+	}
+
+	ili9341_send_params(ili, ILI9341_MADCTL, &madctl, 1);
+}
+
+
+static const u8 ili9341_init_ili9341[] = {
+	0xEF, 3, 0x03, 0x80, 0x02,
+	0xCF, 3, 0x00, 0xC1, 0x30,
+	0xED, 4, 0x64, 0x03, 0x12, 0x81,
+	0xE8, 3, 0x85, 0x00, 0x78,
+	0xCB, 5, 0x39, 0x2C, 0x00, 0x34, 0x02,
+	0xF7, 1, 0x20,
+	0xEA, 2, 0x00, 0x00,
+	ILI9341_PWCTR1, 1, 0x23,		/* VRH[5:0] */
+	ILI9341_PWCTR2, 1, 0x10,		/* SAP[2:0];BT[3:0] */
+	ILI9341_VMCTR1, 2, 0x3e, 0x28,
+	ILI9341_VMCTR2, 1, 0x86,
+	ILI9341_PIXFMT, 1, 0x55,		/* 16 bit */
+	ILI9341_FRMCTR1, 2, 0x00, 0x18,
+	ILI9341_DFUNCTR, 3, 0x08, 0x82, 0x27,
+	0xF2, 1, 0x00,				/* 3Gamma Function Disable */
+	ILI9341_GAMMASET, 1, 0x01,
+	ILI9341_GMCTRP1, 15, 0x0F, 0x31, 0x2B, 0x0C, 0x0E, 0x08, 0x4E, 0xF1,
+		0x37, 0x07, 0x10, 0x03, 0x0E, 0x09, 0x00,
+	ILI9341_GMCTRN1, 15, 0x00, 0x0E, 0x14, 0x03, 0x11, 0x07, 0x31, 0xC1,
+		0x48, 0x08, 0x0F, 0x0C, 0x31, 0x36, 0x0F,
+	ILI9341_SLPOUT, ILI9341_INIT_DELAY, 120,
+	ILI9341_INIT_END,
+};
+
+static const u8 ili9341_init_ili9340[] = {
+	0xEF, 3, 0x03, 0x80, 0x02,
+	0xCF, 3, 0x00, 0xC1, 0x30,
+	0xED, 4, 0x64, 0x03, 0x12, 0x81,
+	0xE8, 3, 0x85, 0x00, 0x78,
+	0xCB, 5, 0x39, 0x2C, 0x00, 0x34, 0x02,
+	0xF7, 1, 0x20,
+	0xEA, 2, 0x00, 0x00,
+	ILI9341_PWCTR1, 1, 0x23,
+	ILI9341_PWCTR2, 1, 0x10,
+	ILI9341_VMCTR1, 2, 0x3e, 0x28,
+	ILI9341_VMCTR2, 1, 0x86,
+	ILI9341_PIXFMT, 1, 0x55,
+	ILI9341_FRMCTR1, 2, 0x00, 0x18,
+	ILI9341_DFUNCTR, 3, 0x08, 0x82, 0x27,
+	ILI9341_SLPOUT, ILI9341_INIT_DELAY, 120,
+	ILI9341_INIT_END,
+};
+
+static const u8 ili9341_init_st7789v[] = {
+	ILI9341_SLPOUT, ILI9341_INIT_DELAY, 120,
+	ILI9341_PIXFMT, 1, 0x55,
+	ST7789_PORCTRL, 5, 0x0C, 0x0C, 0x00, 0x33, 0x33,
+	ST7789_GCTRL, 1, 0x35,
+	ST7789_VCOMS, 1, 0x2B,
+	ST7789_LCMCTRL, 1, 0x2C,
+	ST7789_VDVVRHEN, 2, 0x01, 0xFF,
+	ST7789_VRHS, 1, 0x11,
+	ST7789_VDVS, 1, 0x20,
+	ST7789_FRCTRL2, 1, 0x0F,
+	ST7789_PWCTRL1, 2, 0xA4, 0xA1,
+	ILI9341_GMCTRP1, 14, 0xD0, 0x00, 0x05, 0x0E, 0x15, 0x0D, 0x37, 0x43,
+		0x47, 0x09, 0x15, 0x12, 0x16, 0x19,
+	ILI9341_GMCTRN1, 14, 0xD0, 0x00, 0x05, 0x0D, 0x0C, 0x06, 0x2D, 0x44,
+		0x40, 0x0E, 0x1C, 0x18, 0x16, 0x19,
+	ILI9341_INVON, 0,
+	ILI9341_NORON, 0,
+	ILI9341_INIT_END,
+};
+
+static const u8 ili9341_init_ili9488[] = {
+	ILI9341_GMCTRP1, 15, 0x00, 0x03, 0x09, 0x08, 0x16, 0x0A, 0x3F, 0x78,
+		0x4C, 0x09, 0x0A, 0x08, 0x16, 0x1A, 0x0F,
+	ILI9341_GMCTRN1, 15, 0x00, 0x16, 0x19, 0x03, 0x0F, 0x05, 0x32, 0x45,
+		0x46, 0x04, 0x0E, 0x0D, 0x35, 0x37, 0x0F,
+	ILI9341_PWCTR1, 2, 0x17, 0x15,
+	ILI9341_PWCTR2, 1, 0x41,
+	ILI9341_VMCTR1, 3, 0x00, 0x12, 0x80,
+	ILI9341_PIXFMT, 1, 0x66,		/* 18 bit, the only SPI option */
+	ILI9488_IFMODE, 1, 0x80,
+	ILI9341_FRMCTR1, 1, 0xA0,
+	ILI9341_INVCTR, 1, 0x02,
+	ILI9341_DFUNCTR, 2, 0x02, 0x02,
+	ILI9488_SETIMAGE, 1, 0x00,
+	ILI9488_ADJCTL3, 4, 0xA9, 0x51, 0x2C, 0x82,
+	ILI9341_SLPOUT, ILI9341_INIT_DELAY, 120,
+	ILI9341_INIT_END,
+};
+
+static const struct ili9341_variant ili9341_variants[] = {
+	{
+		.name	= "ili9340",
+		.width	= 240,
+		.height	= 320,
+		.madctl	= 0x48,
+		.bus_bpp = 2,
+		.pack	= ili9341_pack_rgb565,
+		.init	= ili9341_init_ili9340,
+	}, {
+		.name	= "ili9341",
+		.width	= 240,
+		.height	= 320,
+		.madctl	= 0x48,
+		.bus_bpp = 2,
+		.pack	= ili9341_pack_rgb565,
+		.init	= ili9341_init_ili9341,
+	}, {
+		.name	= "st7789v",
+		.width	= 240,
+		.height	= 320,
+		.madctl	= 0x40,
+		.bus_bpp = 2,
+		.pack	= ili9341_pack_rgb565,
+		.init	= ili9341_init_st7789v,
+	}, {
+		.name	= "ili9488",
+		.width	= 320,
+		.height	= 480,
+		.madctl	= 0x48,
+		.bus_bpp = 3,
+		.pack	= ili9341_pack_rgb666,
+		.init	= ili9341_init_ili9488,
+	},
+};
+
+static void ili9341_run_init(struct ili9341 *ili, const u8 *table)
+{
+	u8 cmd, n;
+
+	while (*table != ILI9341_INIT_END) {
+		cmd = *table++;
+		n = *table++;
+		if (n == ILI9341_INIT_DELAY) {
+			ili9341_send_command(ili, cmd);
+			msleep(*table++);
+			continue;
+		}
+		ili9341_send_params(ili, cmd, table, n);
+		table += n;
+	}
+}
+
+#define SCREEN_TEST
+static inline int ili9341_init_chip(struct ili9341 *ili)
+{
+	int ret = 0;
+#ifdef SCREEN_TEST
+	struct fb_info *info = ili->info;
+	unsigned int len = info->var.xres * info->var.yres;
+#endif
+
+	ili9341_reset(ili);
+	ili9341_run_init(ili, ili->variant->init);
+
+	ili9341_set_orientation(ili, ILI9341_ORIENTATION);
+	ili9341_send_command(ili, ILI9341_DISPON); //Display on
+	
+#ifdef SCREEN_TEST
+	/* Shadow is overwritten by the first full frame right after this. */
+	memset(ili->pages[0].oldbuffer, 0x55, len * 2);
+	ili9341_set_window(ili, 0, 0, info->var.xres - 1, info->var.yres - 1);
+	ili9341_write_pixels(ili, ili->pages[0].oldbuffer, len);
+#endif
+/*	if (ret != 0) {
+		dev_err(ili->dev, "failed to initialise display\n");
+		return ret;
+	}*/
+
+	ili->initialised = 1;
+	return ret;
+}
+
+static int ili9341_set_speed(struct ili9341 *ili, u32 hz)
+{
+	int ret;
+
+	ret = ili->bus->set_speed(ili, hz);
+	if (!ret)
+		ili->bus_hz = hz;
+	return ret;
+}
+
+/* Reference replies, taken at tune_min_hz. */
+struct ili9341_tune_ref {
+	u8 rddid[4];
+	u8 rddst[5];
+};
+
+/* One verification pass at the current clock: the ID and status registers
+ * must read back as they did at the reference clock, and a test pattern
+ * written to the top left of GRAM must read back unchanged. */
+static int ili9341_tune_check(struct ili9341 *ili,
+			      const struct ili9341_tune_ref *ref)
+{
+	static const u16 pattern[ILI9341_TUNE_PIXELS] = {
+		0xF800, 0x07E0, 0x001F, 0xFFFF, 0xA5A5, 0x5A5A, 0x0000, 0x8410,
+	};
+	u8 buf[1 + ILI9341_TUNE_PIXELS * 3];
+	unsigned int i;
+	int ret;
+	u16 p;
+
+	if (ili->bus->read(ili, ILI9341_RDDID, buf, sizeof(ref->rddid)) ||
+	    memcmp(buf, ref->rddid, sizeof(ref->rddid)))
+		return -EIO;
+	if (ili->bus->read(ili, ILI9341_RDDST, buf, sizeof(ref->rddst)) ||
+	    memcmp(buf, ref->rddst, sizeof(ref->rddst)))
+		return -EIO;
+
+	ili9341_set_window(ili, 0, 0, ILI9341_TUNE_PIXELS - 1, 0);
+	ili9341_write_pixels(ili, pattern, ILI9341_TUNE_PIXELS);
+	ili9341_set_window(ili, 0, 0, ILI9341_TUNE_PIXELS - 1, 0);
+	ret = ili->bus->read(ili, ILI9341_RAMRD, buf, sizeof(buf));
+	/* no pixels followed that window, and RAMRD moved the pointer */
+	ili9341_addr_invalidate(ili);
+	if (ret)
+		return -EIO;
+
+	/* RAMRD returns 18 bit pixels; compare the bits we wrote. */
+	for (i = 0; i < ILI9341_TUNE_PIXELS; i++) {
+		p = ((buf[1 + i * 3] & 0xf8) << 8) |
+		    ((buf[2 + i * 3] & 0xfc) << 3) |
+		    (buf[3 + i * 3] >> 3);
+		if (p != pattern[i])
+			return -EIO;
+	}
+
+	return 0;
+}
+
+/* Step the bus clock up from tune_min_hz until a readback fails, then settle
+ * tune_margin percent below the last clock that passed. Needs the panel's
+ * SDO line; without it the reference reads are blank and the clock is left
+ * alone. */
+static void ili9341_autotune(struct ili9341 *ili)
+{
+	struct ili9341_tune_ref ref;
+	u32 start = ili->bus_hz;
+	u32 hz, good = 0;
+	int pass;
+
+	if (!ili->bus->read || !ili->bus->set_speed)
+		return;
+
+	ili9341_set_speed(ili, tune_min_hz);
+	if (ili->bus->read(ili, ILI9341_RDDID, ref.rddid, sizeof(ref.rddid)) ||
+	    ili->bus->read(ili, ILI9341_RDDST, ref.rddst, sizeof(ref.rddst)) ||
+	    !memchr_inv(ref.rddid, 0, sizeof(ref.rddid)) ||
+	    !memchr_inv(ref.rddid, 0xff, sizeof(ref.rddid)) ||
+	    ili9341_tune_check(ili, &ref)) {
+		dev_warn(ili->dev, "autotune: no readback, keeping %u Hz\n",
+			 start);
+		ili9341_set_speed(ili, start);
+		return;
+	}
+
+	for (hz = tune_min_hz; ; hz += tune_step_hz) {
+		ili9341_set_speed(ili, hz);
+		for (pass = 0; pass < 3; pass++)
+			if (ili9341_tune_check(ili, &ref))
+				break;
+		if (pass < 3)
+			break;
+		good = hz;
+		/* the next step would wrap past tune_max_hz */
+		if (tune_max_hz - hz < tune_step_hz)
+			break;
+	}
+
+	hz = max_t(u32, tune_min_hz, good / 100 * (100 - tune_margin));
+	ili9341_set_speed(ili, hz);
+	dev_info(ili->dev, "autotune: last good %u Hz, using %u Hz\n",
+		 good, hz);
+}
+
+static inline int ili9341_power_on(struct ili9341 *ili)
+{
+	ili9341_send_command(ili, ILI9341_DISPON); //Display on
+
+	return 0;
+}
+
+static inline int ili9341_power_off(struct ili9341 *ili)
+{
+	ili9341_send_command(ili, ILI9341_DISPOFF); //Display off
+	return 0;
+}
+
+#define POWER_IS_ON(pwr)	((pwr) <= FB_BLANK_NORMAL)
+
+/* Panel bring-up takes a few hundred milliseconds of resets and sleeps, so it
+ * runs here instead of in probe. Anything drawn in the meantime is merged into
+ * the first full-frame upload. */
+static void ili9341_init_work(struct work_struct *work)
+{
+	struct ili9341 *ili = container_of(work, struct ili9341, init_work);
+
+	mutex_lock(&ili->lock);
+	ili9341_init_chip(ili);
+	if (autotune)
+		ili9341_autotune(ili);
+	if (!POWER_IS_ON(ili->power))
+		ili9341_power_off(ili);
+	mutex_unlock(&ili->lock);
+
+	dev_info(ili->dev, "panel initialised\n");
+	ili9341_update_all(ili);
+	/* frames written to the stream device during bring-up */
+	schedule_work(&ili->stream.work);
+
+	/* Drop the reference probe held across bring-up. */
+	pm_runtime_mark_last_busy(ili->dev);
+	pm_runtime_put_autosuspend(ili->dev);
+}
+
+static int ili9341_power(struct ili9341 *lcd, int power)
+{
+	int ret = 0;
+
+	dev_dbg(lcd->dev, "power %d => %d\n", lcd->power, power);
+
+	pm_runtime_get_sync(lcd->dev);
+	mutex_lock(&lcd->lock);
+
+	/* Before bring-up has finished only the state is recorded; the init
+	 * work applies it once the panel is up. */
+	if (!lcd->initialised)
+		goto out;
+
+	if (POWER_IS_ON(power) && !POWER_IS_ON(lcd->power))
+		ret = ili9341_power_on(lcd);
+	else if (!POWER_IS_ON(power) && POWER_IS_ON(lcd->power))
+		ret = ili9341_power_off(lcd);
+
+out:
+	if (ret == 0)
+		lcd->power = power;
 	else
-		ili->backlight=0;
-	/* Item->backlight won't take effect until the LCD is written to. Force that
-	 * by dirty'ing a page. */
-	ili->pages[0].must_update=1;
-	schedule_delayed_work(&info->deferred_work, 0);
+		dev_warn(lcd->dev, "failed to set power mode %d\n", power);
+
+	mutex_unlock(&lcd->lock);
+	pm_runtime_mark_last_busy(lcd->dev);
+	pm_runtime_put_autosuspend(lcd->dev);
+	return ret;
+}
+
+/* Runtime PM: after idle_ms without damage the panel enters sleep mode and
+ * the SPI bus goes quiet, which lets the controller drop its clocks. GRAM
+ * and the shadow buffer stay valid, so waking up is SLPOUT plus a single
+ * bulk upload of the shadow, not a full re-init. */
+static int ili9341_runtime_suspend(struct device *dev)
+{
+	struct ili9341 *ili = dev_get_drvdata(dev);
+
+	mutex_lock(&ili->lock);
+	if (ili->initialised && !ili->asleep) {
+		ili9341_send_command(ili, ILI9341_SLPIN);
+		/* 5ms before the next command may be sent */
+		msleep(5);
+		ili->asleep = 1;
+	}
+	mutex_unlock(&ili->lock);
+
+	return 0;
+}
+
+static int ili9341_runtime_resume(struct device *dev)
+{
+	struct ili9341 *ili = dev_get_drvdata(dev);
+	struct fb_info *info = ili->info;
+	s64 us;
+
+	mutex_lock(&ili->lock);
+	if (!ili->asleep)
+		goto out;
+
+	ili->wake_start = ktime_get();
+	ili9341_send_command(ili, ILI9341_SLPOUT);
+	msleep(5);
+
+	/* a whole frame, sliced like any flush */
+	ili9341_slice_begin(ili);
+	ili9341_set_window(ili, 0, 0, info->var.xres - 1, info->var.yres - 1);
+	ili9341_write_pixels(ili, ili->pages[0].oldbuffer,
+			     info->var.xres * info->var.yres);
+	ili9341_slice_end(ili);
+	ili->cursor.drawn.enable = false;
+	ili->asleep = 0;
+
+	us = ktime_us_delta(ktime_get(), ili->wake_start);
+	ili->wake_latency_us = us;
+	if (ili->wake_latency_us > ili->wake_latency_max_us)
+		ili->wake_latency_max_us = ili->wake_latency_us;
+	ili->wake_count++;
+	dev_dbg(dev, "woke up in %lldus\n", us);
+out:
+	mutex_unlock(&ili->lock);
+
+	return 0;
+}
+
+/* Damage stress test: one thread per online CPU draws random rects straight
+ * into the framebuffer and touches them while the flush worker runs. Once
+ * they stop and the damage has drained, the shadow must match the
+ * framebuffer exactly; any difference is damage that was lost. Started by
+ * writing a duration in ms to debugfs damage_stress; the panel shows noise
+ * while it runs. */
+static int ili9341_stress_thread(void *data)
+{
+	struct ili9341 *ili = data;
+	struct fb_info *info = ili->info;
+	unsigned short *fb = (unsigned short *)info->fix.smem_start;
+	unsigned int x, y, w, h, i, j;
+	unsigned short color;
+
+	while (!kthread_should_stop()) {
+		x = prandom_u32() % info->var.xres;
+		y = prandom_u32() % info->var.yres;
+		w = 1 + prandom_u32() % (info->var.xres - x);
+		h = 1 + prandom_u32() % min(info->var.yres - y, 16U);
+		color = prandom_u32();
+
+		for (j = y; j < y + h; j++)
+			for (i = x; i < x + w; i++)
+				WRITE_ONCE(fb[j * info->var.xres + i], color);
+		ili9341_touch(info, x, y, w, h);
+		cond_resched();
+	}
+
+	return 0;
+}
+
+static int ili9341_stress_set(void *data, u64 val)
+{
+	struct ili9341 *ili = data;
+	struct fb_info *info = ili->info;
+	struct task_struct **tasks;
+	unsigned int len = info->var.xres * info->var.yres * 2;
+	unsigned int cpu, n = 0, i;
+	int ret = 0;
+	LIST_HEAD(none);
+
+	tasks = kcalloc(num_online_cpus(), sizeof(*tasks), GFP_KERNEL);
+	if (!tasks)
+		return -ENOMEM;
+
+	for_each_online_cpu(cpu) {
+		if (n == num_online_cpus())
+			break;
+		tasks[n] = kthread_create(ili9341_stress_thread, ili,
+					  "ili9341-stress/%u", cpu);
+		if (IS_ERR(tasks[n]))
+			break;
+		kthread_bind(tasks[n], cpu);
+		wake_up_process(tasks[n]);
+		n++;
+	}
+
+	msleep(val);
+
+	for (i = 0; i < n; i++)
+		kthread_stop(tasks[i]);
+	kfree(tasks);
+
+	/* Drain: pages skipped as stale are still dirty and get sent now. */
+	if (info->fbdefio)
+		flush_delayed_work(&info->deferred_work);
+	for (i = 0; i <= ILI9341_MAX_DEFER; i++)
+		ili9341_update(info, &none);
+
+	if (memcmp(ili->pages[0].oldbuffer, (void *)info->fix.smem_start,
+		   len)) {
+		dev_err(ili->dev, "damage stress: shadow out of sync\n");
+		ret = -EIO;
+	} else {
+		dev_info(ili->dev, "damage stress: %u writers, no damage lost\n",
+			 n);
+	}
+
+	return ret;
+}
+DEFINE_SIMPLE_ATTRIBUTE(ili9341_stress_fops, NULL, ili9341_stress_set,
+			"%llu\n");
+
+/* Co-tenant benchmark: a thread stands in for another device on the same
+ * SPI bus, taking the bus every millisecond and timing how long it waits,
+ * while the driver sends full frames. Writing N to debugfs cotenant_bench
+ * runs N frames without slicing and N frames with the current slice
+ * settings; the cotenant file shows both. Needs bus=spi or spi9. */
+static int ili9341_cotenant_thread(void *data)
+{
+	struct ili9341 *ili = data;
+	struct ili9341_cotenant *ct = &ili->cotenant[!ili->slice.off];
+	ktime_t t0;
+	u64 ns;
+
+	while (!kthread_should_stop()) {
+		t0 = ktime_get();
+		spi_bus_lock(ili->spi->master);
+		ns = ktime_to_ns(ktime_sub(ktime_get(), t0));
+		spi_bus_unlock(ili->spi->master);
+
+		ct->samples++;
+		ct->total_ns += ns;
+		if (ns > ct->max_ns)
+			ct->max_ns = ns;
+		usleep_range(1000, 1100);
+	}
+
 	return 0;
 }
 
-static void ili9341_touch(struct fb_info *info, int x, int y, int w, int h) 
+static int ili9341_cotenant_set(void *data, u64 val)
 {
-	struct fb_deferred_io *fbdefio = info->fbdefio;
-	struct ili9341 *ili = (struct ili9341 *)info->par;
-	int i, ystart, yend;
-	if (fbdefio) {
-		/* Touch the pages the y-range hits, so the deferred io will update them. */
-		for (i=0; i<ili->pages_count; i++) {
-			ystart=ili->pages[i].y;
-			yend=ili->pages[i].y+(ili->pages[i].len/info->fix.line_length)+1;
-			if (!((y+h)<ystart || y>yend)) {
-				ili->pages[i].must_update=1;
-			}
+	struct ili9341 *ili = data;
+	struct ili9341_cotenant *ct;
+	struct task_struct *task;
+	unsigned int pass, i;
+	ktime_t start;
+
+	if (ili->bus != &ili9341_spi_bus && ili->bus != &ili9341_spi9_bus)
+		return -EOPNOTSUPP;
+
+	for (pass = 0; pass < 2; pass++) {
+		ct = &ili->cotenant[pass];
+		memset(ct, 0, sizeof(*ct));
+		ili->slice.off = !pass;
+
+		task = kthread_run(ili9341_cotenant_thread, ili,
+				   "ili9341-cotenant");
+		if (IS_ERR(task)) {
+			ili->slice.off = false;
+			return PTR_ERR(task);
+		}
+
+		start = ktime_get();
+		for (i = 0; i < val; i++) {
+			WRITE_ONCE(ili->full_update, 1);
+			ili9341_do_flush(ili);
 		}
-		/* Schedule the deferred IO to kick in after a delay.*/
-		schedule_delayed_work(&info->deferred_work, fbdefio->delay);
+		ct->flush_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		kthread_stop(task);
 	}
+	ili->slice.off = false;
+
+	return 0;
 }
+DEFINE_SIMPLE_ATTRIBUTE(ili9341_cotenant_bench_fops, NULL,
+			ili9341_cotenant_set, "%llu\n");
 
-static void ili9341_fillrect(struct fb_info *p, const struct fb_fillrect *rect) 
+static int ili9341_cotenant_show(struct seq_file *m, void *v)
 {
-	sys_fillrect(p, rect);
-	ili9341_touch(p, rect->dx, rect->dy, rect->width, rect->height);
+	struct ili9341 *ili = m->private;
+	static const char * const names[] = { "unsliced", "sliced" };
+	struct ili9341_cotenant *ct;
+	unsigned int i;
+
+	seq_puts(m, "mode      samples  avg_wait_us  max_wait_us  frames_ms\n");
+	for (i = 0; i < 2; i++) {
+		ct = &ili->cotenant[i];
+		seq_printf(m, "%-9s %7llu  %11llu  %11llu  %9llu\n", names[i],
+			   ct->samples,
+			   ct->samples ? div64_u64(ct->total_ns, ct->samples) /
+					 NSEC_PER_USEC : 0,
+			   div64_u64(ct->max_ns, NSEC_PER_USEC),
+			   div64_u64(ct->flush_ns, NSEC_PER_MSEC));
+	}
+	return 0;
 }
 
-static void ili9341_imageblit(struct fb_info *p, const struct fb_image *image) 
+static int ili9341_cotenant_open(struct inode *inode, struct file *file)
 {
-	sys_imageblit(p, image);
-	ili9341_touch(p, image->dx, image->dy, image->width, image->height);
+	return single_open(file, ili9341_cotenant_show, inode->i_private);
 }
 
-static void ili9341_copyarea(struct fb_info *p, const struct fb_copyarea *area) 
+static const struct file_operations ili9341_cotenant_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ili9341_cotenant_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static ssize_t spi_speed_hz_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
 {
-	sys_copyarea(p, area);
-	ili9341_touch(p, area->dx, area->dy, area->width, area->height);
+	struct ili9341 *ili = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", ili->bus_hz);
 }
 
-static ssize_t ili9341_write(struct fb_info *p, const char __user *buf, 
-				size_t count, loff_t *ppos) 
+static ssize_t spi_speed_hz_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
 {
-	ssize_t res;
-	res = fb_sys_write(p, buf, count, ppos);
-	ili9341_touch(p, 0, 0, p->var.xres, p->var.yres);
-	return res;
-}
+	struct ili9341 *ili = dev_get_drvdata(dev);
+	u32 hz;
+	int ret;
 
+	ret = kstrtou32(buf, 0, &hz);
+	if (ret)
+		return ret;
+	if (!ili->bus->set_speed)
+		return -EOPNOTSUPP;
 
-static struct fb_ops ili9341_fbops = {
-	.owner        = THIS_MODULE,
-	.fb_read      = fb_sys_read,
-	.fb_write     = ili9341_write,
-	.fb_fillrect  = ili9341_fillrect,
-	.fb_copyarea  = ili9341_copyarea,
-	.fb_imageblit = ili9341_imageblit,
-	.fb_setcolreg	= ili9341_setcolreg,
-	.fb_blank	= ili9341_blank,
-};
+	mutex_lock(&ili->lock);
+	ret = ili9341_set_speed(ili, hz);
+	mutex_unlock(&ili->lock);
 
-static struct fb_fix_screeninfo ili9341_fix __initdata = {
-	.id          = "ILI9341",
-	.type        = FB_TYPE_PACKED_PIXELS,
-	.visual      = FB_VISUAL_TRUECOLOR,
-	.accel       = FB_ACCEL_NONE,
-	.line_length = ILI9341_TFTWIDTH * 2,
-};
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(spi_speed_hz);
 
-static struct fb_var_screeninfo ili9341_var __initdata = {
-	.xres		= ILI9341_TFTWIDTH,
-	.yres		= ILI9341_TFTHEIGHT,
-	.xres_virtual	= ILI9341_TFTWIDTH,
-	.yres_virtual	= ILI9341_TFTHEIGHT,
-	.width		= ILI9341_TFTWIDTH,
-	.height		= ILI9341_TFTHEIGHT,
-	.bits_per_pixel	= 16,
-	/* Pixel format is RGB565 packed */
-	.red		= {11, 5, 0},
-	.green		= {5, 6, 0},
-	.blue		= {0, 5, 0},
-	.activate	= FB_ACTIVATE_NOW,
-	.vmode		= FB_VMODE_NONINTERLACED,
+static struct attribute *ili9341_attrs[] = {
+	&dev_attr_spi_speed_hz.attr,
+	NULL,
 };
 
-static struct fb_deferred_io ili9341_defio = {
-	.delay          = HZ / 50,
-	.deferred_io    = &ili9341_update,
+static const struct attribute_group ili9341_attr_group = {
+	.attrs = ili9341_attrs,
 };
 
-void ili9341_set_orientation(struct ili9341 *ili, uint8_t flags)
+static int ili9341_trace_enable_get(void *data, u64 *val)
 {
-	uint8_t madctl = 0x48;
+	struct ili9341 *ili = data;
 
-	if (flags & ILI9341_FLIP_X) {
-		madctl &= ~(1 << 6);
-	}
+	*val = ili->trace.enable;
+	return 0;
+}
 
-	if (flags & ILI9341_FLIP_Y) {
-		madctl |= 1 << 7;
+/* Writing 1 starts a fresh capture, 0 stops it. The records stay readable
+ * from the trace file until the next start. */
+static int ili9341_trace_enable_set(void *data, u64 val)
+{
+	struct ili9341 *ili = data;
+	struct ili9341_trace *tr = &ili->trace;
+	struct ili9341_trace_rec *recs = NULL, *old;
+
+	if (val) {
+		recs = vmalloc(trace_len * sizeof(*recs));
+		if (!recs)
+			return -ENOMEM;
 	}
 
-	if (flags & ILI9341_SWITCH_XY) {
-		madctl |= 1 << 5;
+	mutex_lock(&tr->mutex);
+	spin_lock_irq(&tr->lock);
+	old = val ? tr->recs : NULL;
+	if (val) {
+		tr->recs = recs;
+		tr->len = trace_len;
+		tr->count = 0;
+		tr->dropped = 0;
 	}
+	tr->enable = !!val;
+	spin_unlock_irq(&tr->lock);
 
-	ili9341_send_command(ili, ILI9341_MADCTL);
-	ili9341_send_byte(ili, madctl);
+	vfree(old);
+	mutex_unlock(&tr->mutex);
+	return 0;
 }
+DEFINE_SIMPLE_ATTRIBUTE(ili9341_trace_enable_fops, ili9341_trace_enable_get,
+			ili9341_trace_enable_set, "%llu\n");
 
+static ssize_t ili9341_trace_read(struct file *file, char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	struct ili9341 *ili = file->private_data;
+	struct ili9341_trace *tr = &ili->trace;
+	ssize_t ret = 0;
+
+	/* the mutex keeps a restart from freeing recs under us */
+	mutex_lock(&tr->mutex);
+	if (tr->recs)
+		ret = simple_read_from_buffer(buf, count, ppos, tr->recs,
+				READ_ONCE(tr->count) * sizeof(*tr->recs));
+	mutex_unlock(&tr->mutex);
+	return ret;
+}
 
-#define SCREEN_TEST
-static inline int ili9341_init_chip(struct ili9341 *ili)
+static const struct file_operations ili9341_trace_fops = {
+	.owner	= THIS_MODULE,
+	.open	= simple_open,
+	.read	= ili9341_trace_read,
+	.llseek	= default_llseek,
+};
+
+/* Replay: feed a captured trace back through the flush engine. It runs on a
+ * scratch engine with its own framebuffer and shadow and the null bus, so
+ * the panel and the live shadow are not touched. Each
+ * traced rect or page is inverted in the scratch framebuffer, i.e. every
+ * damaged pixel really changes, and each FLUSH_BEGIN runs one flush. */
+static void ili9341_replay_damage(struct ili9341 *r, unsigned int x,
+				  unsigned int y, unsigned int w,
+				  unsigned int h)
 {
-	int ret = 0;
-#ifdef SCREEN_TEST
-	int x,y;
-#endif
+	struct fb_info *info = r->info;
+	unsigned short *fb = (unsigned short *)info->fix.smem_start;
+	unsigned long stamp = ili9341_damage_stamp(r);
+	unsigned int i, j, ystart, yend;
+
+	if (x >= info->var.xres || y >= info->var.yres)
+		return;
+	w = min(w, info->var.xres - x);
+	h = min(h, info->var.yres - y);
+
+	for (j = y; j < y + h; j++)
+		for (i = x; i < x + w; i++)
+			fb[j * info->var.xres + i] ^= 0xffff;
+
+	for (i = 0; i < r->pages_count; i++) {
+		ili9341_page_lines(r, i, &ystart, &yend);
+		if (ystart < y + h && yend > y)
+			ili9341_damage_page(r, i, stamp);
+	}
+}
 
-	ili9341_reset(ili);
+/* Scratch flush engine: a fresh ili9341 with only what ili9341_flush()
+ * uses filled in, on a private copy of the current picture with its shadow
+ * in sync, and the null bus. */
+static struct ili9341 *ili9341_scratch_alloc(struct ili9341 *ili)
+{
+	struct fb_info *info = ili->info;
+	unsigned int frame = info->var.xres * info->var.yres * 2;
+	struct fb_info *rinfo;
+	struct ili9341 *r;
+	unsigned short *fb;
+
+	r = kzalloc(sizeof(*r), GFP_KERNEL);
+	rinfo = kzalloc(sizeof(*rinfo), GFP_KERNEL);
+	fb = vmalloc(info->fix.smem_len);
+	if (!r || !rinfo || !fb)
+		goto out;
+
+	rinfo->var = info->var;
+	rinfo->fix = info->fix;
+	rinfo->fix.smem_start = (unsigned long)fb;
+	rinfo->par = r;
+
+	r->dev = ili->dev;
+	r->variant = ili->variant;
+	r->bus = &ili9341_null_bus;
+	r->info = rinfo;
+	r->pages_count = ili->pages_count;
+	mutex_init(&r->lock);
+	spin_lock_init(&r->trace.lock);
+	atomic_long_set(&r->damage_seq, 0);
+
+	r->txbuf = kmalloc(BLOCKLEN, GFP_KERNEL);
+	r->cmdbuf = kmalloc(ILI9341_CMDBUF_LEN, GFP_KERNEL);
+	if (!r->txbuf || !r->cmdbuf || ili9341_pages_alloc(r))
+		goto out_buf;
+
+	memcpy(fb, ili->pages[0].buffer, frame);
+	memcpy(r->pages[0].oldbuffer, fb, frame);
+	return r;
+
+out_buf:
+	kfree(r->cmdbuf);
+	kfree(r->txbuf);
+out:
+	vfree(fb);
+	kfree(rinfo);
+	kfree(r);
+	return NULL;
+}
 
-	ili9341_send_command(ili, 0xEF);
-	ili9341_send_byte(ili, 0x03);
-	ili9341_send_byte(ili, 0x80);
-	ili9341_send_byte(ili, 0x02);
-	ili9341_send_command(ili, 0xCF);
-	ili9341_send_byte(ili, 0x00);
-	ili9341_send_byte(ili, 0XC1);
-	ili9341_send_byte(ili, 0X30);
-	ili9341_send_command(ili, 0xED);
-	ili9341_send_byte(ili, 0x64);
-	ili9341_send_byte(ili, 0x03);
-	ili9341_send_byte(ili, 0X12);
-	ili9341_send_byte(ili, 0X81);
-	ili9341_send_command(ili, 0xE8);
-	ili9341_send_byte(ili, 0x85);
-	ili9341_send_byte(ili, 0x00);
-	ili9341_send_byte(ili, 0x78);
-	ili9341_send_command(ili, 0xCB);
-	ili9341_send_byte(ili, 0x39);
-	ili9341_send_byte(ili, 0x2C);
-	ili9341_send_byte(ili, 0x00);
-	ili9341_send_byte(ili, 0x34);
-	ili9341_send_byte(ili, 0x02);
-	ili9341_send_command(ili, 0xF7);
-	ili9341_send_byte(ili, 0x20);
-	ili9341_send_command(ili, 0xEA);
-	ili9341_send_byte(ili, 0x00);
-	ili9341_send_byte(ili, 0x00);
-	ili9341_send_command(ili, ILI9341_PWCTR1); //Power control
-	ili9341_send_byte(ili, 0x23); //VRH[5:0]
-	ili9341_send_command(ili, ILI9341_PWCTR2); //Power control
-	ili9341_send_byte(ili, 0x10); //SAP[2:0];BT[3:0]
-	ili9341_send_command(ili, ILI9341_VMCTR1); //VCM control
-	ili9341_send_byte(ili, 0x3e); //¶Ô±È¶Èµ÷½Ú
-	ili9341_send_byte(ili, 0x28);
-	ili9341_send_command(ili, ILI9341_VMCTR2); //VCM control2
-	ili9341_send_byte(ili, 0x86); //--
-	ili9341_send_command(ili, ILI9341_MADCTL); // Memory Access Control
-	ili9341_send_byte(ili, 0x48);
-	ili9341_send_command(ili, ILI9341_PIXFMT);
-	ili9341_send_byte(ili, 0x55);
-	ili9341_send_command(ili, ILI9341_FRMCTR1);
-	ili9341_send_byte(ili, 0x00);
-	ili9341_send_byte(ili, 0x18);
-	ili9341_send_command(ili, ILI9341_DFUNCTR); // Display Function Control
-	ili9341_send_byte(ili, 0x08);
-	ili9341_send_byte(ili, 0x82);
-	ili9341_send_byte(ili, 0x27);
-	ili9341_send_command(ili, 0xF2); // 3Gamma Function Disable
-	ili9341_send_byte(ili, 0x00);
-	ili9341_send_command(ili, ILI9341_GAMMASET); //Gamma curve selected
-	ili9341_send_byte(ili, 0x01);
-	ili9341_send_command(ili, ILI9341_GMCTRP1); //Set Gamma
-	ili9341_send_byte(ili, 0x0F);
-	ili9341_send_byte(ili, 0x31);
-	ili9341_send_byte(ili, 0x2B);
-	ili9341_send_byte(ili, 0x0C);
-	ili9341_send_byte(ili, 0x0E);
-	ili9341_send_byte(ili, 0x08);
-	ili9341_send_byte(ili, 0x4E);
-	ili9341_send_byte(ili, 0xF1);
-	ili9341_send_byte(ili, 0x37);
-	ili9341_send_byte(ili, 0x07);
-	ili9341_send_byte(ili, 0x10);
-	ili9341_send_byte(ili, 0x03);
-	ili9341_send_byte(ili, 0x0E);
-	ili9341_send_byte(ili, 0x09);
-	ili9341_send_byte(ili, 0x00);
-	ili9341_send_command(ili, ILI9341_GMCTRN1); //Set Gamma
-	ili9341_send_byte(ili, 0x00);
-	ili9341_send_byte(ili, 0x0E);
-	ili9341_send_byte(ili, 0x14);
-	ili9341_send_byte(ili, 0x03);
-	ili9341_send_byte(ili, 0x11);
-	ili9341_send_byte(ili, 0x07);
-	ili9341_send_byte(ili, 0x31);
-	ili9341_send_byte(ili, 0xC1);
-	ili9341_send_byte(ili, 0x48);
-	ili9341_send_byte(ili, 0x08);
-	ili9341_send_byte(ili, 0x0F);
-	ili9341_send_byte(ili, 0x0C);
-	ili9341_send_byte(ili, 0x31);
-	ili9341_send_byte(ili, 0x36);
-	ili9341_send_byte(ili, 0x0F);
-	ili9341_send_command(ili, ILI9341_SLPOUT); //Exit Sleep
-	mdelay(120);
-	
-	ili9341_set_orientation(ili, ILI9341_SWITCH_XY | ILI9341_FLIP_X);
-	ili9341_send_command(ili, ILI9341_DISPON); //Display on
-	
-#ifdef SCREEN_TEST
-	ili9341_set_window(ili, 0, 0, ILI9341_TFTWIDTH, ILI9341_TFTHEIGHT);
-	for(y=ILI9341_TFTHEIGHT; y>0; y--) {
-		for(x=ILI9341_TFTWIDTH; x>0; x--) {
-			ili9341_send_byte(ili, 0x55);
-			ili9341_send_byte(ili, 0x55);
+static void ili9341_scratch_free(struct ili9341 *r)
+{
+	ili9341_pages_free(r);
+	kfree(r->cmdbuf);
+	kfree(r->txbuf);
+	vfree((void *)r->info->fix.smem_start);
+	kfree(r->info);
+	kfree(r);
+}
+
+static int ili9341_replay_run(struct ili9341 *ili,
+			      const struct ili9341_trace_rec *recs,
+			      unsigned int n)
+{
+	struct ili9341_replay_stats *st = &ili->replay;
+	struct ili9341_page *page;
+	struct ili9341 *r;
+	unsigned int i, j;
+	ktime_t start;
+
+	memset(st, 0, sizeof(*st));
+	r = ili9341_scratch_alloc(ili);
+	if (!r) {
+		st->error = -ENOMEM;
+		return -ENOMEM;
+	}
+
+	start = ktime_get();
+	for (i = 0; i < n; i++) {
+		switch (recs[i].type) {
+		case ILI9341_TRACE_TOUCH:
+			ili9341_replay_damage(r, recs[i].x, recs[i].y,
+					      recs[i].w, recs[i].h);
+			break;
+		case ILI9341_TRACE_PAGE:
+			if (recs[i].x >= r->pages_count)
+				break;
+			page = &r->pages[recs[i].x];
+			for (j = 0; j < page->len; j++)
+				page->buffer[j] ^= 0xffff;
+			ili9341_damage_page(r, recs[i].x,
+					    ili9341_damage_stamp(r));
+			break;
+		case ILI9341_TRACE_FLUSH_BEGIN:
+			ili9341_flush(r);
+			st->flushes++;
+			break;
+		case ILI9341_TRACE_FLUSH:
+			st->traced_bytes += recs[i].bytes;
+			break;
 		}
 	}
-#endif
-/*	if (ret != 0) {
-		dev_err(ili->dev, "failed to initialise display\n");
-		return ret;
-	}*/
+	st->cpu_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	st->records = n;
+	st->commands = r->bus_stats.commands;
+	st->param_bytes = r->bus_stats.param_bytes;
+	st->pixel_bytes = r->bus_stats.pixel_bytes;
+	st->addr_saved_bytes = r->addr.saved_bytes;
+
+	ili9341_scratch_free(r);
+	return 0;
+}
 
-	ili->initialised = 1;
+static int ili9341_replay_open(struct inode *inode, struct file *file)
+{
+	struct ili9341_replay_file *rf;
+
+	rf = kzalloc(sizeof(*rf), GFP_KERNEL);
+	if (!rf)
+		return -ENOMEM;
+	rf->recs = vmalloc(trace_len * sizeof(*rf->recs));
+	if (!rf->recs) {
+		kfree(rf);
+		return -ENOMEM;
+	}
+	rf->ili = inode->i_private;
+	file->private_data = rf;
+
+	return 0;
+}
+
+static ssize_t ili9341_replay_write(struct file *file, const char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	struct ili9341_replay_file *rf = file->private_data;
+	ssize_t ret;
+
+	ret = simple_write_to_buffer(rf->recs,
+				     trace_len * sizeof(*rf->recs),
+				     ppos, buf, count);
+	if (ret > 0)
+		rf->len = max_t(size_t, rf->len, *ppos);
 	return ret;
 }
 
-static inline int ili9341_power_on(struct ili9341 *ili)
+/* The trace is replayed once it has been written completely. The VFS drops
+ * the return value of release, so a failure shows in replay_stats. */
+static int ili9341_replay_release(struct inode *inode, struct file *file)
 {
+	struct ili9341_replay_file *rf = file->private_data;
+	struct ili9341 *ili = rf->ili;
+	int ret;
 
-	if (!ili->initialised)
-		ili9341_init_chip(ili);
+	mutex_lock(&ili->replay_lock);
+	ret = ili9341_replay_run(ili, rf->recs, rf->len / sizeof(*rf->recs));
+	mutex_unlock(&ili->replay_lock);
+	vfree(rf->recs);
+	kfree(rf);
 
-	ili9341_send_command(ili, ILI9341_DISPON); //Display on
+	return ret;
+}
+
+static const struct file_operations ili9341_replay_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ili9341_replay_open,
+	.write		= ili9341_replay_write,
+	.release	= ili9341_replay_release,
+	.llseek		= no_llseek,
+};
 
+static int ili9341_replay_show(struct seq_file *m, void *v)
+{
+	struct ili9341 *ili = m->private;
+	struct ili9341_replay_stats *st = &ili->replay;
+
+	mutex_lock(&ili->replay_lock);
+	seq_printf(m, "records:      %llu\n", st->records);
+	seq_printf(m, "flushes:      %llu\n", st->flushes);
+	seq_printf(m, "commands:     %llu\n", st->commands);
+	seq_printf(m, "param_bytes:  %llu\n", st->param_bytes);
+	seq_printf(m, "pixel_bytes:  %llu\n", st->pixel_bytes);
+	seq_printf(m, "traced_bytes: %llu\n", st->traced_bytes);
+	seq_printf(m, "addr_saved_bytes: %llu\n", st->addr_saved_bytes);
+	seq_printf(m, "cpu_ns:       %llu\n", st->cpu_ns);
+	seq_printf(m, "error:        %d\n", st->error);
+	mutex_unlock(&ili->replay_lock);
 	return 0;
 }
 
-static inline int ili9341_power_off(struct ili9341 *ili)
+static int ili9341_replay_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ili9341_replay_show, inode->i_private);
+}
+
+static const struct file_operations ili9341_replay_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ili9341_replay_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* Fault vs scan benchmark. Writing N to debugfs scan_bench draws N frames
+ * at each damage ratio on a scratch engine with the null bus and flushes
+ * them twice: once as deferred io would, with only the written pages dirty,
+ * and once as a scan tick would, a memcmp of the frame and then every page
+ * dirty. scan_vs_fault shows the cost per frame of each and the page faults
+ * a deferred io frame takes. The fault cost itself depends on the CPU; it
+ * has to be measured from userspace (e.g. with perf) and added on. */
+static const unsigned int ili9341_bench_ratios[ILI9341_BENCH_RATIOS] = {
+	1, 10, 25, 50, 100,
+};
+
+/* Invert count pages from first on, so every pixel in them changes. */
+static void ili9341_bench_draw(struct ili9341 *r, unsigned int first,
+			       unsigned int count)
 {
-	ili9341_send_command(ili, ILI9341_DISPOFF); //Display on
+	struct ili9341_page *page;
+	unsigned int i, j;
+
+	for (i = 0; i < count; i++) {
+		page = &r->pages[(first + i) % r->pages_count];
+		for (j = 0; j < page->len; j++)
+			page->buffer[j] ^= 0xffff;
+	}
+}
+
+static int ili9341_scan_bench_set(void *data, u64 val)
+{
+	struct ili9341 *ili = data;
+	unsigned int frame = ili->info->var.xres * ili->info->var.yres * 2;
+	struct ili9341_scan_bench *b;
+	struct ili9341 *r;
+	unsigned int i, j, k, f;
+	unsigned long stamp;
+	ktime_t start;
+
+	if (!val)
+		return -EINVAL;
+	r = ili9341_scratch_alloc(ili);
+	if (!r)
+		return -ENOMEM;
+
+	for (i = 0; i < ILI9341_BENCH_RATIOS; i++) {
+		b = &ili->scan_bench[i];
+		memset(b, 0, sizeof(*b));
+		b->ratio = ili9341_bench_ratios[i];
+		k = max(DIV_ROUND_UP(r->pages_count * b->ratio, 100), 1U);
+		b->faults = k;
+
+		/* deferred io: the pagelist names the written pages */
+		for (f = 0; f < val; f++) {
+			ili9341_bench_draw(r, f * k, k);
+			start = ktime_get();
+			stamp = ili9341_damage_stamp(r);
+			for (j = 0; j < k; j++)
+				ili9341_damage_page(r, (f * k + j) %
+						    r->pages_count, stamp);
+			ili9341_flush(r);
+			b->fault_ns += ktime_to_ns(ktime_sub(ktime_get(),
+							     start));
+		}
+
+		/* scan: compare the frame, then diff all of it */
+		for (f = 0; f < val; f++) {
+			ili9341_bench_draw(r, f * k, k);
+			start = ktime_get();
+			if (memcmp(r->pages[0].oldbuffer, r->pages[0].buffer,
+				   frame)) {
+				stamp = ili9341_damage_stamp(r);
+				for (j = 0; j < r->pages_count; j++)
+					ili9341_damage_page(r, j, stamp);
+				ili9341_flush(r);
+			}
+			b->scan_ns += ktime_to_ns(ktime_sub(ktime_get(),
+							    start));
+		}
+
+		b->fault_ns = div64_u64(b->fault_ns, val);
+		b->scan_ns = div64_u64(b->scan_ns, val);
+	}
+
+	ili9341_scratch_free(r);
 	return 0;
 }
+DEFINE_SIMPLE_ATTRIBUTE(ili9341_scan_bench_fops, NULL, ili9341_scan_bench_set,
+			"%llu\n");
 
-#define POWER_IS_ON(pwr)	((pwr) <= FB_BLANK_NORMAL)
+static int ili9341_scan_vs_fault_show(struct seq_file *m, void *v)
+{
+	struct ili9341 *ili = m->private;
+	struct ili9341_scan_bench *b;
+	unsigned int i;
+
+	seq_puts(m, "damage%  faults/frame  defio_flush_us  scan_tick_us\n");
+	for (i = 0; i < ILI9341_BENCH_RATIOS; i++) {
+		b = &ili->scan_bench[i];
+		seq_printf(m, "%7u  %12u  %14llu  %12llu\n", b->ratio,
+			   b->faults, div64_u64(b->fault_ns, NSEC_PER_USEC),
+			   div64_u64(b->scan_ns, NSEC_PER_USEC));
+	}
+	return 0;
+}
 
-static int ili9341_power(struct ili9341 *lcd, int power)
+static int ili9341_scan_vs_fault_open(struct inode *inode, struct file *file)
 {
-	int ret = 0;
-#if 0
-	dev_dbg(lcd->dev, "power %d => %d\n", lcd->power, power);
+	return single_open(file, ili9341_scan_vs_fault_show,
+			   inode->i_private);
+}
 
-	if (POWER_IS_ON(power) && !POWER_IS_ON(lcd->power))
-		ret = ili9341_power_on(lcd);
-	else if (!POWER_IS_ON(power) && POWER_IS_ON(lcd->power))
-		ret = ili9341_power_off(lcd);
+static const struct file_operations ili9341_scan_vs_fault_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ili9341_scan_vs_fault_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
 
-	if (ret == 0)
-		lcd->power = power;
-	else
-		dev_warn(lcd->dev, "failed to set power mode %d\n", power);
-#endif
-	return ret;
+static void ili9341_debugfs_init(struct ili9341 *ili)
+{
+	ili->debugfs = debugfs_create_dir(dev_name(ili->dev), NULL);
+	if (IS_ERR_OR_NULL(ili->debugfs))
+		return;
+
+	debugfs_create_u32("wake_count", 0444, ili->debugfs,
+			   &ili->wake_count);
+	debugfs_create_u32("wake_latency_us", 0444, ili->debugfs,
+			   &ili->wake_latency_us);
+	debugfs_create_u32("wake_latency_max_us", 0644, ili->debugfs,
+			   &ili->wake_latency_max_us);
+
+	debugfs_create_u32("stale_skipped", 0444, ili->debugfs,
+			   &ili->stale_skipped);
+
+	debugfs_create_u64("flushes", 0644, ili->debugfs, &ili->flushes);
+	debugfs_create_u64("parallel_flushes", 0644, ili->debugfs,
+			   &ili->parallel_flushes);
+	debugfs_create_u64("flush_ns", 0644, ili->debugfs, &ili->flush_ns);
+	debugfs_create_file("scan_bench", 0200, ili->debugfs, ili,
+			    &ili9341_scan_bench_fops);
+	debugfs_create_file("scan_vs_fault", 0444, ili->debugfs, ili,
+			    &ili9341_scan_vs_fault_fops);
+	debugfs_create_u64("flips", 0644, ili->debugfs, &ili->flips);
+	debugfs_create_u64("addr_continues", 0644, ili->debugfs,
+			   &ili->addr.continues);
+	debugfs_create_u64("addr_saved_bytes", 0644, ili->debugfs,
+			   &ili->addr.saved_bytes);
+	debugfs_create_u64("slice_holds", 0644, ili->debugfs,
+			   &ili->slice.holds);
+	debugfs_create_u64("slice_yields", 0644, ili->debugfs,
+			   &ili->slice.yields);
+	debugfs_create_u64("slice_hold_ns", 0644, ili->debugfs,
+			   &ili->slice.hold_ns);
+	debugfs_create_u64("slice_max_hold_ns", 0644, ili->debugfs,
+			   &ili->slice.max_hold_ns);
+	debugfs_create_file("cotenant_bench", 0200, ili->debugfs, ili,
+			    &ili9341_cotenant_bench_fops);
+	debugfs_create_file("cotenant", 0444, ili->debugfs, ili,
+			    &ili9341_cotenant_fops);
+	debugfs_create_u64("cursor_updates", 0644, ili->debugfs,
+			   &ili->cursor.updates);
+	debugfs_create_u64("cursor_bytes", 0644, ili->debugfs,
+			   &ili->cursor.bytes);
+	debugfs_create_u64("defio_pages", 0644, ili->debugfs,
+			   &ili->defio_pages);
+	debugfs_create_u64("scans", 0644, ili->debugfs, &ili->scans);
+	debugfs_create_u64("scan_ns", 0644, ili->debugfs, &ili->scan_ns);
+
+	debugfs_create_u64("bus_commands", 0644, ili->debugfs,
+			   &ili->bus_stats.commands);
+	debugfs_create_u64("bus_param_bytes", 0644, ili->debugfs,
+			   &ili->bus_stats.param_bytes);
+	debugfs_create_u64("bus_pixel_bytes", 0644, ili->debugfs,
+			   &ili->bus_stats.pixel_bytes);
+	debugfs_create_u64("bus_first_ns", 0644, ili->debugfs,
+			   &ili->bus_stats.first_ns);
+	debugfs_create_u64("bus_last_ns", 0644, ili->debugfs,
+			   &ili->bus_stats.last_ns);
+	debugfs_create_file("damage_stress", 0200, ili->debugfs, ili,
+			    &ili9341_stress_fops);
+
+	debugfs_create_file("trace_enable", 0644, ili->debugfs, ili,
+			    &ili9341_trace_enable_fops);
+	debugfs_create_file("trace", 0444, ili->debugfs, ili,
+			    &ili9341_trace_fops);
+	debugfs_create_u32("trace_dropped", 0444, ili->debugfs,
+			   &ili->trace.dropped);
+	debugfs_create_file("replay", 0200, ili->debugfs, ili,
+			    &ili9341_replay_fops);
+	debugfs_create_file("replay_stats", 0444, ili->debugfs, ili,
+			    &ili9341_replay_stats_fops);
+
+	debugfs_create_u32("stream_frames", 0444, ili->debugfs,
+			   &ili->stream.frames);
+	debugfs_create_u32("stream_dropped", 0444, ili->debugfs,
+			   &ili->stream.dropped);
+	debugfs_create_u32("stream_fps", 0444, ili->debugfs,
+			   &ili->stream.fps);
 }
 
-int ili9341_probe_spi(struct spi_device *spi)
+/* Everything but the transport lookup is shared by SPI panels and the
+ * null panel, which has no spi_device at all (spi is NULL). */
+static int ili9341_probe(struct device *dev, struct spi_device *spi,
+			 const struct ili9341_variant *variant)
 {
-	struct device *dev = &spi->dev;
 	struct ili9341 *ili;
 	struct fb_info *info;
+	unsigned int i;
 	int ret = 0;
 
 	/* verify we where given some information */
-	
-	ili = devm_kzalloc(&spi->dev, sizeof(struct ili9341), GFP_KERNEL);
+	if (autotune && (!tune_step_hz || tune_min_hz > tune_max_hz ||
+			 tune_margin >= 100)) {
+		dev_err(dev, "autotune: bad range %u..%u Hz step %u margin %u%%\n",
+			tune_min_hz, tune_max_hz, tune_step_hz, tune_margin);
+		return -EINVAL;
+	}
+
+	ili = devm_kzalloc(dev, sizeof(struct ili9341), GFP_KERNEL);
 	if (ili == NULL) {
 		dev_err(dev, "no memory for device\n");
 		return -ENOMEM;
 	}
 	ili->dev = dev;
-	spi->mode = SPI_MODE_0;
-	spi_setup(spi);
+	ili->variant = variant;
+	mutex_init(&ili->lock);
+	spin_lock_init(&ili->trace.lock);
+	mutex_init(&ili->trace.mutex);
+	mutex_init(&ili->replay_lock);
+	INIT_WORK(&ili->init_work, ili9341_init_work);
+	INIT_WORK(&ili->cursor.work, ili9341_cursor_work);
+	spin_lock_init(&ili->cursor.lock);
+
+	dev_set_drvdata(dev, ili);
+	dev_info(dev, "registered, item=0x%p\n", (void *)ili);
 
-	spi_set_drvdata(spi, ili);
-	dev_info(&spi->dev, "spi registered, item=0x%p\n", (void *)ili);
+	ili->spi = spi;
 
-	ili->gpiodc = 16;
-	gpio_request(ili->gpiodc, "ili9341 dc pin");
-	gpio_direction_output(ili->gpiodc, 0);
-	dev_info(&spi->dev, "gpio %i registered\n", ili->gpiodc);
+	ili->txbuf = devm_kmalloc(dev, BLOCKLEN, GFP_KERNEL | GFP_DMA);
+	ili->cmdbuf = devm_kmalloc(dev, ILI9341_CMDBUF_LEN,
+				   GFP_KERNEL | GFP_DMA);
+	if (!ili->txbuf || !ili->cmdbuf)
+		return -ENOMEM;
+
+	if (!spi)
+		ili->bus = &ili9341_null_bus;
+	else
+		for (i = 0; i < ARRAY_SIZE(ili9341_buses); i++)
+			if (!strcmp(bus, ili9341_buses[i]->name))
+				ili->bus = ili9341_buses[i];
+	if (!ili->bus) {
+		dev_err(dev, "unknown bus '%s'\n", bus);
+		return -EINVAL;
+	}
+	ret = ili->bus->init(ili);
+	if (ret)
+		return ret;
 
-	ili->gpiorst = 12;
-	gpio_request(ili->gpiorst, "ili9341 reset pin");
-	gpio_direction_output(ili->gpiorst, 0);
-	dev_info(&spi->dev, "gpio %i registered\n", ili->gpiorst);
+	ili->bus_hz = spi ? spi->max_speed_hz : 0;
 
-	ili->spi = spi;
-	
-	info = framebuffer_alloc(sizeof(struct ili9341), &spi->dev);
+	ili->gpiorst = ili->bus == &ili9341_null_bus ? -1 : rst_gpio;
+	if (gpio_is_valid(ili->gpiorst)) {
+		gpio_request(ili->gpiorst, "ili9341 reset pin");
+		gpio_direction_output(ili->gpiorst, 0);
+		dev_info(dev, "gpio %i registered\n", ili->gpiorst);
+	}
+
+	info = framebuffer_alloc(sizeof(struct ili9341), dev);
 	if (!info) {
 		ret = -ENOMEM;
-		dev_err(&spi->dev,
+		dev_err(dev,
 			"%s: unable to framebuffer_alloc\n", __func__);
-		goto out_item;
+		return ret;
 	}
 	info->pseudo_palette = &ili->pseudo_palette;
 	ili->info = info;
 	info->par = ili;
-	info->dev = &spi->dev;
+	info->dev = dev;
 	info->fbops = &ili9341_fbops;
 	info->flags = FBINFO_FLAG_DEFAULT | FBINFO_VIRTFB;
 	info->fix = ili9341_fix;
 	info->var = ili9341_var;
+	strlcpy(info->fix.id, ili->variant->name, sizeof(info->fix.id));
+	if (ILI9341_ORIENTATION & ILI9341_SWITCH_XY) {
+		info->var.xres = ili->variant->height;
+		info->var.yres = ili->variant->width;
+	} else {
+		info->var.xres = ili->variant->width;
+		info->var.yres = ili->variant->height;
+	}
+	info->var.xres_virtual = info->var.width = info->var.xres;
+	info->var.yres_virtual = info->var.height = info->var.yres;
+	info->fix.line_length = info->var.xres * 2;
+	if (flip) {
+		info->var.yres_virtual = info->var.yres * 2;
+		info->fix.ypanstep = info->var.yres;
+	}
 
 	ret = ili9341_video_alloc(ili);
 	if (ret) {
-		dev_err(&spi->dev,
+		dev_err(dev,
 			"%s: unable to ili9341_video_alloc\n", __func__);
 		goto out_info;
 	}
@@ -683,123 +3461,271 @@ int ili9341_probe_spi(struct spi_device *spi)
 
 	ret = ili9341_pages_alloc(ili);
 	if (ret < 0) {
-		dev_err(&spi->dev,
+		dev_err(dev,
 			"%s: unable to ili9341_pages_init\n", __func__);
 		goto out_video;
 	}
 
-	info->fbdefio = &ili9341_defio;
-	fb_deferred_io_init(info);
+	INIT_DELAYED_WORK(&ili->scan_work, ili9341_scan_work);
+	INIT_DELAYED_WORK(&ili->flip_work, ili9341_flip_work);
+	init_waitqueue_head(&ili->flip_wait);
+	init_waitqueue_head(&ili->fence_wait);
+	spin_lock_init(&ili->fence_lock);
+	if (flip) {
+		if (scan_hz)
+			dev_warn(dev, "scan_hz is ignored in flip mode\n");
+		scan_hz = 0;
+		ili9341_fbops.fb_mmap = ili9341_mmap;
+		ili9341_fbops.fb_pan_display = ili9341_pan_display;
+	} else if (scan_hz) {
+		ili9341_fbops.fb_mmap = ili9341_mmap;
+	} else {
+		info->fbdefio = &ili9341_defio;
+		fb_deferred_io_init(info);
+	}
 
 	ret = register_framebuffer(info);
 	if (ret < 0) {
-		dev_err(&spi->dev,
+		dev_err(dev,
 			"%s: unable to register_frambuffer\n", __func__);
 		goto out_pages;
 	}
-	
-	ili9341_init_chip(ili);
-	ili9341_update_all(ili);
+
+	ret = ili9341_stream_init(ili);
+	if (ret < 0) {
+		dev_err(dev,
+			"%s: unable to register stream device\n", __func__);
+		goto out_fb;
+	}
+
+	ret = sysfs_create_group(&dev->kobj, &ili9341_attr_group);
+	if (ret < 0) {
+		dev_err(dev,
+			"%s: unable to create sysfs attributes\n", __func__);
+		goto out_stream;
+	}
+
+	/* Hold the panel awake until the init work has brought it up. */
+	pm_runtime_get_noresume(dev);
+	pm_runtime_set_active(dev);
+	pm_runtime_set_autosuspend_delay(dev, idle_ms);
+	pm_runtime_use_autosuspend(dev);
+	pm_runtime_enable(dev);
+
+	ili9341_debugfs_init(ili);
+
+	schedule_work(&ili->init_work);
+	if (scan_hz)
+		schedule_delayed_work(&ili->scan_work, HZ / scan_hz);
 
 	return ret;
 
+out_stream:
+	ili9341_stream_exit(ili);
+out_fb:
+	unregister_framebuffer(info);
+	/* fbcon may have drawn, blinked or panned since registration */
+	cancel_work_sync(&ili->cursor.work);
+	cancel_delayed_work_sync(&ili->flip_work);
 out_pages:
+	if (info->fbdefio)
+		fb_deferred_io_cleanup(info);
 	ili9341_pages_free(ili);
 out_video:
 	ili9341_video_free(ili);
 out_info:
 	framebuffer_release(info);
-out_item:
-	kfree(ili);
 	return ret;
 }
 
-int ili9341_remove(struct spi_device *spi)
+int ili9341_probe_spi(struct spi_device *spi)
+{
+	spi->mode = SPI_MODE_0;
+	spi_setup(spi);
+
+	return ili9341_probe(&spi->dev, spi, (const struct ili9341_variant *)
+			     spi_get_device_id(spi)->driver_data);
+}
+
+static void ili9341_remove_common(struct ili9341 *ili)
 {
-	struct ili9341 *ili = spi_get_drvdata(spi);
-	struct fb_info *info = dev_get_drvdata(&spi->dev);
+	struct device *dev = ili->dev;
+	struct fb_info *info = ili->info;
+	unsigned int i;
 
-	dev_set_drvdata(&spi->dev, NULL);
+	cancel_work_sync(&ili->init_work);
+	sysfs_remove_group(&dev->kobj, &ili9341_attr_group);
+	ili9341_stream_exit(ili);
 	unregister_framebuffer(info);
+	cancel_work_sync(&ili->cursor.work);
+	if (info->fbdefio)
+		fb_deferred_io_cleanup(info);
+	else
+		cancel_delayed_work_sync(&ili->scan_work);
+	cancel_delayed_work_sync(&ili->flip_work);
+	for (i = 0; i < ILI9341_MAX_FENCES; i++)
+		if (ili->fences[i].ctx)
+			eventfd_ctx_put(ili->fences[i].ctx);
+	debugfs_remove_recursive(ili->debugfs);
+	vfree(ili->trace.recs);
+
+	pm_runtime_dont_use_autosuspend(dev);
+	pm_runtime_disable(dev);
+	pm_runtime_set_suspended(dev);
+	dev_set_drvdata(dev, NULL);
+
 	ili9341_pages_free(ili);
 	ili9341_video_free(ili);
 	framebuffer_release(info);
-	
+}
+
+int ili9341_remove(struct spi_device *spi)
+{
+	ili9341_remove_common(spi_get_drvdata(spi));
 	return 0;
 }
 
-#ifdef CONFIG_PM_SLEEP1
-int ili9341_suspend(struct ili9341 *lcd)
+#ifdef CONFIG_PM_SLEEP
+static int ili9341_suspend(struct device *dev)
 {
+	struct ili9341 *lcd = dev_get_drvdata(dev);
 	int ret;
 
+	/* resume puts back whatever blanking was in effect */
+	lcd->suspend_power = lcd->power;
 	ret = ili9341_power(lcd, FB_BLANK_POWERDOWN);
+	if (ret)
+		return ret;
 
 /*	if (lcd->platdata->suspend == ILI9341_SUSPEND_DEEP) {
 		lcd->initialised = 0;
 	}
 */
-	return ret;
+	return pm_runtime_force_suspend(dev);
 }
 
-int ili9341_resume(struct ili9341 *lcd)
+static int ili9341_resume(struct device *dev)
 {
+	struct ili9341 *lcd = dev_get_drvdata(dev);
+	int ret;
+
 	dev_info(lcd->dev, "resuming from power state %d\n", lcd->power);
 #if 0
 	if (lcd->platdata->suspend == ILI9341_SUSPEND_DEEP)
 		ili9341_write(lcd, ILI9341_POWER1, 0x00);
 #endif
-	return ili9341_power(lcd, FB_BLANK_UNBLANK);
+	ret = pm_runtime_force_resume(dev);
+	if (ret)
+		return ret;
+
+	return ili9341_power(lcd, lcd->suspend_power);
 }
 #endif
 
+static const struct dev_pm_ops ili9341_pm_ops = {
+	SET_SYSTEM_SLEEP_PM_OPS(ili9341_suspend, ili9341_resume)
+	SET_RUNTIME_PM_OPS(ili9341_runtime_suspend, ili9341_runtime_resume,
+			   NULL)
+};
+
 /* Power down all displays on reboot, poweroff or halt */
-void ili9341_shutdown(struct ili9341 *lcd)
+static void ili9341_shutdown(struct spi_device *spi)
 {
+	struct ili9341 *lcd = spi_get_drvdata(spi);
+
 	ili9341_power(lcd, FB_BLANK_POWERDOWN);
 }
 
+static const struct spi_device_id ili9341_ids[] = {
+	{ "ili9340", (kernel_ulong_t)&ili9341_variants[0] },
+	{ "ili9341", (kernel_ulong_t)&ili9341_variants[1] },
+	{ "st7789v", (kernel_ulong_t)&ili9341_variants[2] },
+	{ "ili9488", (kernel_ulong_t)&ili9341_variants[3] },
+	{ }
+};
+MODULE_DEVICE_TABLE(spi, ili9341_ids);
+
 static struct spi_driver ili9341_driver = {
 	.driver = {
 		.name		= "ili9341",
 		.owner		= THIS_MODULE,
-//		.pm		= &vgg2432a4_pm_ops,
+		.probe_type	= PROBE_PREFER_ASYNCHRONOUS,
+		.pm		= &ili9341_pm_ops,
 	},
+	.id_table	= ili9341_ids,
 	.probe		= ili9341_probe_spi,
 	.remove		= ili9341_remove,
-//	.shutdown	= vgg2432a4_shutdown,
+	.shutdown	= ili9341_shutdown,
 };
 
-module_spi_driver(ili9341_driver);
-#if 0
+/* bus=null without hardware: null_panel=1 adds a panel that is not bound
+ * to any SPI device, so the null bus benchmarks run on any machine. */
+static int ili9341_probe_null(struct platform_device *pdev)
+{
+	return ili9341_probe(&pdev->dev, NULL, &ili9341_variants[1]);
+}
+
+static int ili9341_remove_null(struct platform_device *pdev)
+{
+	ili9341_remove_common(platform_get_drvdata(pdev));
+	return 0;
+}
+
+static struct platform_driver ili9341_null_driver = {
+	.driver = {
+		.name		= "ili9341-null",
+		.probe_type	= PROBE_PREFER_ASYNCHRONOUS,
+		.pm		= &ili9341_pm_ops,
+	},
+	.probe		= ili9341_probe_null,
+	.remove		= ili9341_remove_null,
+};
+
+static struct platform_device *ili9341_null_pdev;
+
 static int __init ili9341_init(void)
 {
-#if 0
 	int ret;
 
-	ret = gpio_request_one(GPIO_EEPROM_OE, GPIOF_OUT_INIT_HIGH,
-				"93xx46 EEPROMs OE");
+	ret = spi_register_driver(&ili9341_driver);
 	if (ret) {
-		pr_err("can't request gpio %d\n", GPIO_EEPROM_OE);
+		pr_err("Failed to register ILI9341 SPI driver: %d\n", ret);
 		return ret;
 	}
-#endif
-	int ret = spi_register_driver(&ili9341_driver);
-	if (ret) {
-			pr_err("Failed to register ILI9341 SPI driver: %d\n", ret);
-			return ret;
+	if (!null_panel)
+		return 0;
+
+	ret = platform_driver_register(&ili9341_null_driver);
+	if (ret)
+		goto out_spi;
+	ili9341_null_pdev = platform_device_register_simple("ili9341-null",
+							    -1, NULL, 0);
+	if (IS_ERR(ili9341_null_pdev)) {
+		ret = PTR_ERR(ili9341_null_pdev);
+		goto out_platform;
 	}
+
+	return 0;
+
+out_platform:
+	platform_driver_unregister(&ili9341_null_driver);
+out_spi:
+	pr_err("Failed to add the ILI9341 null panel: %d\n", ret);
+	spi_unregister_driver(&ili9341_driver);
 	return ret;
 }
 
 static void __exit ili9341_cleanup(void)
 {
+	if (null_panel) {
+		platform_device_unregister(ili9341_null_pdev);
+		platform_driver_unregister(&ili9341_null_driver);
+	}
 	spi_unregister_driver(&ili9341_driver);
 }
-#endif
 
-//module_init(ili9341_init);
-//module_exit(ili9341_cleanup);
+module_init(ili9341_init);
+module_exit(ili9341_cleanup);
 
 MODULE_AUTHOR("Ben Dooks <ben-linux@fluff.org>");
 MODULE_DESCRIPTION("ILI9320 LCD Driver");
@@ -12,22 +12,274 @@
  * published by the Free Software Foundation.
 */
 
+struct ili9341;
+
+/* Converts n RGB565 framebuffer pixels to the controller's wire format. */
+typedef void (*ili9341_pack_t)(u8 *dst, const u16 *src, unsigned int n);
+
+/* One supported controller: native (portrait) geometry, init table and the
+ * pixel format it is driven with. The framebuffer is always RGB565. */
+struct ili9341_variant {
+	const char		*name;
+	unsigned short		width;
+	unsigned short		height;
+	u8			madctl;	/* MADCTL before orientation flags */
+	unsigned int		bus_bpp; /* bytes per pixel on the wire */
+	ili9341_pack_t		pack;
+	const u8		*init;
+};
+
+/* Changed run of one line, found by the diff; x0 < 0 means unchanged. */
+struct ili9341_span {
+	short x0;
+	short x1;
+};
+
+/* A horizontal band of the frame, diffed and packed on its own CPU. */
+struct ili9341_band {
+	struct work_struct	work;
+	struct ili9341		*ili;
+	unsigned int		y0, y1;
+};
+
+#define ILI9341_MAX_BANDS	8
+
+/* Transport to the controller. command_params sends a command byte
+ * followed by its parameters; pixels sends already packed pixel data after
+ * RAMWR. Callers hold ili->lock. */
+struct ili9341_bus_ops {
+	const char	*name;
+	int		(*init)(struct ili9341 *ili);
+	int		(*command)(struct ili9341 *ili, u8 cmd);
+	int		(*command_params)(struct ili9341 *ili, u8 cmd,
+					  const u8 *params, size_t n);
+	int		(*pixels)(struct ili9341 *ili, const u8 *buf, size_t len);
+	/* Optional: read len bytes (dummy cycle included) after cmd. */
+	int		(*read)(struct ili9341 *ili, u8 cmd, u8 *buf, size_t len);
+	/* Optional: change the bus clock. */
+	int		(*set_speed)(struct ili9341 *ili, u32 hz);
+};
+
+/* What the spi9 self test mock latched. */
+#define ILI9341_SPI9_MOCK_BYTES	40
+
+struct ili9341_spi9_mock {
+	u8		cmd;
+	u8		cmds[4];
+	u8		params[8];
+	u8		pixels[ILI9341_SPI9_MOCK_BYTES];
+	unsigned int	ncmds, nparams, npixels;
+};
+
+/* 9 bit stream being built by the spi9 backend. */
+struct ili9341_spi9 {
+	u8			*buf;
+	size_t			len;	/* whole bytes in buf */
+	u32			acc;	/* bits not yet in buf */
+	unsigned int		bits;
+	bool			mock;	/* decode instead of sending */
+	struct ili9341_spi9_mock decoded;
+};
+
+/* What the driver believes the controller's address window and write
+ * pointer are; next_y is the row the pointer is at after the last run. */
+struct ili9341_addr {
+	bool		valid;
+	u16		x0, x1, y0, y1;
+	u16		next_y;
+	u64		continues;	/* runs sent with RAMWRC */
+	u64		saved_bytes;	/* command + parameter bytes skipped */
+};
+
+/* Traffic seen by the null backend. */
+struct ili9341_bus_stats {
+	u64		commands;
+	u64		param_bytes;
+	u64		pixel_bytes;
+	u64		first_ns;
+	u64		last_ns;
+};
+
+#define ILI9341_TUNE_PIXELS	8
+
+#define ILI9341_8080_MAX_DB	16
+#define ILI9341_CMDBUF_LEN	64
+
 struct ili9341_page {
 	unsigned short x;
 	unsigned short y;
 	unsigned short *buffer;
 	unsigned short *oldbuffer;
 	unsigned short len;
-	int must_update;
+	unsigned long stamp;	/* damage sequence number of the last touch */
+	unsigned int deferred;	/* flushes skipped because it was redrawn */
+};
+
+/* One dirty page as seen by the flush scheduler. */
+struct ili9341_flush_entry {
+	unsigned short index;
+	unsigned short prio;
+	unsigned long stamp;
+};
+
+#define ILI9341_STREAM_SLOTS	3
+
+/* Full-frame streaming through the write-only fbN-stream device. One slot
+ * is filled by the writer, one waits for the bus and one is on the wire;
+ * a newer frame replaces a waiting one instead of queueing behind it. */
+struct ili9341_stream {
+	struct miscdevice		misc;
+	char				name[16];
+	unsigned long			busy;	/* bit 0: device is open */
+	wait_queue_head_t		release_wait;
+
+	spinlock_t			lock;	/* protects pending/sending */
+	void				*slot[ILI9341_STREAM_SLOTS];
+	int				pending;
+	int				sending;
+	struct work_struct		work;
+	int				window_set;
+
+	u32				frames;
+	u32				dropped;
+	u32				fps;
+	u32				fps_frames;
+	ktime_t				fps_start;
+};
+
+/* Hardware-style cursor, composited into the panel by the driver and never
+ * into the framebuffer. Bitmaps are fbcon's: one bit per pixel, MSB first,
+ * rows padded to a byte. */
+#define ILI9341_CURSOR_MAX	32
+#define ILI9341_CURSOR_BYTES	(ILI9341_CURSOR_MAX / 8 * ILI9341_CURSOR_MAX)
+
+struct ili9341_cursor_state {
+	u16		x, y, w, h;
+	bool		enable;
+	u8		rop;
+	u32		fg, bg;
+	u8		image[ILI9341_CURSOR_BYTES];
+	u8		mask[ILI9341_CURSOR_BYTES];
+};
+
+struct ili9341_cursor {
+	spinlock_t			lock;	/* protects next */
+	struct ili9341_cursor_state	next;	/* as last set by fbcon */
+	struct ili9341_cursor_state	drawn;	/* on the panel, under ili->lock */
+	bool				hit;	/* a flush overwrote drawn */
+	struct work_struct		work;
+	u16				pix[ILI9341_CURSOR_MAX * ILI9341_CURSOR_MAX];
+	u64				updates;
+	u64				bytes;
+};
+
+/* Bus time slicing for the spi backend: a flush holds the bus with
+ * spi_bus_lock() for at most one slice, then lets other devices in. */
+struct ili9341_slice {
+	bool		active;	/* inside a flush */
+	bool		held;	/* spi_bus_lock() taken */
+	bool		off;	/* forced off by the benchmark */
+	ktime_t		start;
+	size_t		bytes;
+	u64		holds;
+	u64		yields;
+	u64		hold_ns;
+	u64		max_hold_ns;
+};
+
+/* Bus wait seen by a simulated co-tenant device, see cotenant_bench. */
+struct ili9341_cotenant {
+	u64		samples;
+	u64		total_ns;
+	u64		max_ns;
+	u64		flush_ns;
+};
+
+/* An eventfd waiting for a fence. */
+#define ILI9341_MAX_FENCES	8
+
+struct ili9341_fence {
+	struct eventfd_ctx	*ctx;
+	u64			seq;
+};
+
+/* Damage trace capture, see ILI9341_TRACE_* in ili9341_ioctl.h. Recording
+ * stops when the buffer is full so the trace stays contiguous. */
+struct ili9341_trace {
+	spinlock_t			lock;	/* recording */
+	struct mutex			mutex;	/* recs lifetime, for readers */
+	struct ili9341_trace_rec	*recs;
+	unsigned int			len;
+	unsigned int			count;
+	u32				dropped;
+	int				enable;
+};
+
+/* Result of the last replay through the null bus. */
+struct ili9341_replay_stats {
+	u64				records;
+	u64				flushes;
+	u64				commands;
+	u64				param_bytes;
+	u64				pixel_bytes;
+	u64				traced_bytes;	/* what the original run sent */
+	u64				addr_saved_bytes;
+	u64				cpu_ns;
+	int				error;
+};
+
+/* One damage ratio of the fault vs scan benchmark, per frame. */
+#define ILI9341_BENCH_RATIOS	5
+
+struct ili9341_scan_bench {
+	unsigned int			ratio;	/* % of pages written */
+	unsigned int			faults;
+	u64				fault_ns;
+	u64				scan_ns;
+};
+
+/* A trace being written to debugfs replay, one per open file. */
+struct ili9341_replay_file {
+	struct ili9341			*ili;
+	struct ili9341_trace_rec	*recs;
+	size_t				len;	/* bytes */
 };
 
 /* ILI9341 device state. */
 struct ili9341 {
 	struct spi_device		*spi;	/* SPI attachged device. */
 	struct device			*dev;
+	const struct ili9341_variant	*variant;
+	const struct ili9341_bus_ops	*bus;
+	u8				*txbuf;	/* BLOCKLEN bytes of packed pixels */
+	u8				*cmdbuf; /* command parameters */
+	struct ili9341_bus_stats	bus_stats;
+	struct ili9341_spi9		spi9;
+	struct ili9341_addr		addr;
+	u32				bus_hz;	/* current bus clock */
+	u8				mock_gram[ILI9341_TUNE_PIXELS * 3];
+
+	/* 8080 parallel bus */
+	struct gpio_desc		*db[ILI9341_8080_MAX_DB];
+	int				db_values[ILI9341_8080_MAX_DB];
+	unsigned int			db_width;
+	int				gpiowr;
 	struct fb_info			*info;
 	unsigned int			pages_count;
 	struct ili9341_page	*pages;
+	struct ili9341_flush_entry	*flush_order;
+	unsigned long			*dirty;	/* one bit per page */
+	atomic_long_t			damage_seq;
+
+	/* parallel diff */
+	struct ili9341_band		*bands;
+	unsigned int			bands_count;
+	struct ili9341_span		*spans;	/* one per line */
+	u8				*line_dirty;
+	u8				*packbuf; /* whole frame, wire format */
+	u64				parallel_flushes;
+	unsigned int			prio_y0, prio_y1; /* lines sent first */
+	u32				stale_skipped;
 	unsigned long			pseudo_palette[17];
 	int						backlight;
 
@@ -35,5 +287,56 @@ struct ili9341 {
 	int				gpiorst;
 
 	int				 power; /* current power state. */
+	int				 suspend_power; /* power before system sleep */
 	int				 initialised;
+	int				 full_update; /* next flush sends the whole frame */
+
+	struct mutex			lock;	/* serialises panel access */
+	struct work_struct		init_work; /* background panel bring-up */
+
+	int				 asleep; /* panel is in SLPIN */
+	ktime_t				 wake_start;
+	u32				 wake_count;
+	u32				 wake_latency_us; /* last SLPOUT to first pixel */
+	u32				 wake_latency_max_us;
+
+	int				 streaming; /* stream device owns the panel */
+	struct ili9341_stream		 stream;
+
+	struct ili9341_cursor		 cursor;
+
+	/* completion fences */
+	atomic64_t			 fence_submitted;
+	u64				 fence_done;
+	wait_queue_head_t		 fence_wait;
+	spinlock_t			 fence_lock;
+	struct ili9341_fence		 fences[ILI9341_MAX_FENCES];
+	u64				 tx_bytes;	/* pixel bytes sent */
+	u32				 bytes_per_sec;	/* measured, 0 = not yet */
+	u32				 last_flush_us;
+
+	struct ili9341_slice		 slice;
+	struct ili9341_cotenant		 cotenant[2]; /* unsliced, sliced */
+
+	struct delayed_work		 scan_work; /* scan mode only */
+
+	/* page flip mode */
+	struct delayed_work		 flip_work;
+	unsigned int			 front_y; /* yoffset of the front buffer */
+	u32				 flip_seq;  /* flips requested */
+	u32				 flip_done; /* flips on the panel */
+	wait_queue_head_t		 flip_wait;
+	u64				 flips;
+	u64				 flushes;
+	u64				 flush_ns;
+	u64				 defio_pages;
+	u64				 scans;
+	u64				 scan_ns;
+
+	struct ili9341_trace		 trace;
+	struct mutex			 replay_lock;
+	struct ili9341_scan_bench	 scan_bench[ILI9341_BENCH_RATIOS];
+	struct ili9341_replay_stats	 replay;
+
+	struct dentry			*debugfs;
 };
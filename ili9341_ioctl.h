@@ -0,0 +1,75 @@
+/* ili9341_ioctl.h
+ *
+ * ILI9341 framebuffer driver private ioctls, on top of the standard
+ * FBIO* set.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+*/
+
+#ifndef __ILI9341_IOCTL_H
+#define __ILI9341_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+struct ili9341_rect {
+	__u16 x;
+	__u16 y;
+	__u16 w;
+	__u16 h;
+};
+
+/* Lines covered by this rect are flushed before any other damage, e.g. the
+ * area around the cursor or the widget receiving input. h = 0 clears it. */
+#define ILI9341_IOCTL_SET_PRIORITY	_IOW('F', 0xA0, struct ili9341_rect)
+
+/* Frame completion fences. SUBMIT covers everything drawn so far, starts a
+ * flush at once and returns a sequence number; the fence completes when a
+ * flush that covers it has reached the panel. Wait for it with WAIT_FENCE,
+ * or have an eventfd signalled with FENCE_EVENTFD and poll that. SUBMIT
+ * fails with EBUSY before the panel is up and while /dev/fbN-stream
+ * is open. */
+struct ili9341_fence_eventfd {
+	__s32 fd;
+	__u32 pad;
+	__u64 seq;
+};
+
+/* Where the fences stand, and what the bus can sustain: a full frame takes
+ * frame_budget_us at the measured bytes_per_sec, so rendering faster than
+ * one frame per budget only produces frames that get merged. */
+struct ili9341_fence_info {
+	__u64 submitted;
+	__u64 completed;
+	__u32 frame_bytes;
+	__u32 bytes_per_sec;
+	__u32 frame_budget_us;
+	__u32 last_flush_us;
+};
+
+#define ILI9341_IOCTL_SUBMIT		_IOR('F', 0xA1, __u64)
+#define ILI9341_IOCTL_WAIT_FENCE	_IOW('F', 0xA2, __u64)
+#define ILI9341_IOCTL_FENCE_EVENTFD	_IOW('F', 0xA3, struct ili9341_fence_eventfd)
+#define ILI9341_IOCTL_FENCE_INFO	_IOR('F', 0xA4, struct ili9341_fence_info)
+
+/* Damage trace, as read from debugfs <device>/trace and fed back through
+ * debugfs <device>/replay. Records are in time order. */
+#define ILI9341_TRACE_TOUCH		1	/* x, y, w, h: drawn rect */
+#define ILI9341_TRACE_PAGE		2	/* x: defio page index */
+#define ILI9341_TRACE_FLUSH_BEGIN	3	/* flush engine started */
+#define ILI9341_TRACE_FLUSH		4	/* x, y, w, h sent, bytes */
+
+struct ili9341_trace_rec {
+	__u64 ts_ns;
+	__u8 type;
+	__u8 pad[3];
+	__u16 x;
+	__u16 y;
+	__u16 w;
+	__u16 h;
+	__u32 bytes;
+};
+
+#endif
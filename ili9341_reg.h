@@ -16,10 +16,10 @@
 #define ILI9341_FLIP_Y 2
 #define ILI9341_SWITCH_XY 4
 
-//#define ILI9341_TFTWIDTH 240
-//#define ILI9341_TFTHEIGHT 320
-#define ILI9341_TFTWIDTH 320
-#define ILI9341_TFTHEIGHT 240
+/* Init tables: command, parameter count, parameters. A parameter count of
+ * ILI9341_INIT_DELAY means the next byte is a delay in ms instead. */
+#define ILI9341_INIT_DELAY 0xFE
+#define ILI9341_INIT_END 0xFF
 
 
 #define ILI9341_NOP 0x00
@@ -44,6 +44,7 @@
 #define ILI9341_PASET 0x2B
 #define ILI9341_RAMWR 0x2C
 #define ILI9341_RAMRD 0x2E
+#define ILI9341_RAMWRC 0x3C
 #define ILI9341_PTLAR 0x30
 #define ILI9341_MADCTL 0x36
 #define ILI9341_PIXFMT 0x3A
@@ -65,6 +66,22 @@
 #define ILI9341_RDID4 0xDD
 #define ILI9341_GMCTRP1 0xE0
 #define ILI9341_GMCTRN1 0xE1
+
+/* ST7789V */
+#define ST7789_PORCTRL 0xB2
+#define ST7789_GCTRL 0xB7
+#define ST7789_VCOMS 0xBB
+#define ST7789_LCMCTRL 0xC0
+#define ST7789_VDVVRHEN 0xC2
+#define ST7789_VRHS 0xC3
+#define ST7789_VDVS 0xC4
+#define ST7789_FRCTRL2 0xC6
+#define ST7789_PWCTRL1 0xD0
+
+/* ILI9488 */
+#define ILI9488_IFMODE 0xB0
+#define ILI9488_SETIMAGE 0xE9
+#define ILI9488_ADJCTL3 0xF7
 /*
 #define ILI9341_PWCTR6 0xFC
 */